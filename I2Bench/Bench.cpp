@@ -0,0 +1,483 @@
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <iostream>
+#include <omp.h>
+
+#include "Parser.h"
+#include "Core.h"
+
+using namespace i2t;
+
+namespace {
+
+    struct Ray {
+        dvec3 ro;
+        dvec3 rd;
+    };
+
+    struct Triangle {
+        dvec3 v0, v1, v2;
+    };
+
+    struct Sphere {
+        dmat4 invT;
+        dmat4 T;
+    };
+
+    struct Result {
+        bool hit;
+        double t;
+    };
+
+    enum class Pattern {
+        hit,
+        miss,
+        grazing
+    };
+
+    static const char* pattern_name (Pattern p) {
+        switch (p) {
+        case Pattern::hit:      return "hit";
+        case Pattern::miss:     return "miss";
+        case Pattern::grazing:  return "grazing";
+        }
+        return "?";
+    }
+
+    /* One workload = the rays plus the primitive each ray is tested against. */
+    struct Workload {
+        std::vector<Ray>        rays;
+        std::vector<Triangle>   triangles;
+        std::vector<Sphere>     spheres;
+        std::vector<double>     tmax;
+        std::vector<std::uint32_t> first;
+    };
+
+    typedef std::function<void (Core&, const Workload&, std::vector<Result>&)> kernel_type;
+
+    struct Variant {
+        std::string name;
+        kernel_type run;
+    };
+
+    struct Bench {
+        std::string     name;
+        Pattern         pattern;
+        Workload        work;
+        std::vector<Variant> variants;
+    };
+
+    struct Rng {
+        std::mt19937_64 engine;
+        std::uniform_real_distribution<double> unit {0.0, 1.0};
+
+        explicit Rng (std::uint64_t seed): engine (seed) {}
+
+        double operator () () { return unit (engine); }
+        double operator () (double a, double b) { return a + (b - a)*unit (engine); }
+
+        dvec3 direction () {
+            auto z = (*this) (-1.0, 1.0);
+            auto p = (*this) (0.0, 2.0*3.14159265359);
+            auto r = std::sqrt (std::max (0.0, 1.0 - z*z));
+            return dvec3 (r*std::cos (p), r*std::sin (p), z);
+        }
+
+        dvec3 perpendicular (const dvec3& d) {
+            auto a = std::abs (d.x) < 0.9 ? dvec3 (1.0, 0.0, 0.0) : dvec3 (0.0, 1.0, 0.0);
+            auto u = normalize (cross (d, a));
+            auto v = cross (d, u);
+            auto p = (*this) (0.0, 2.0*3.14159265359);
+            return u*std::cos (p) + v*std::sin (p);
+        }
+    };
+
+    /* Point offset from the center of the unit sphere, perpendicular to dir,
+       by a distance chosen according to the pattern (inside, outside or on
+       the rim). */
+    static dvec3 unit_sphere_target (Rng& rng, const dvec3& dir, Pattern p) {
+        auto offset = 0.0;
+        switch (p) {
+        case Pattern::hit:      offset = rng (0.0, 0.95); break;
+        case Pattern::miss:     offset = rng (1.05, 3.0); break;
+        case Pattern::grazing:  offset = rng (0.999, 1.001); break;
+        }
+        return rng.perpendicular (dir)*offset;
+    }
+
+    static Ray unit_sphere_ray (Rng& rng, Pattern p) {
+        auto dir = rng.direction ();
+        auto ro = unit_sphere_target (rng, dir, p) - dir*rng (3.0, 10.0);
+        return {ro, dir};
+    }
+
+    static Triangle random_triangle (Rng& rng) {
+        auto c = dvec3 (rng (-1.0, 1.0), rng (-1.0, 1.0), rng (-1.0, 1.0));
+        return {
+            c + rng.direction ()*rng (0.1, 1.0),
+            c + rng.direction ()*rng (0.1, 1.0),
+            c + rng.direction ()*rng (0.1, 1.0)
+        };
+    }
+
+    /* Point given in barycentric coordinates; misses land outside the
+       triangle, grazing points land within 1e-4 of an edge. */
+    static dvec3 triangle_target (Rng& rng, const Triangle& tri, Pattern p) {
+        double u, v;
+        switch (p) {
+        case Pattern::hit:
+            u = rng (0.05, 0.9);
+            v = rng (0.05, 0.95 - u);
+            break;
+        case Pattern::miss:
+            u = rng (-1.0, -0.05);
+            v = rng (0.0, 1.0);
+            if (rng () < 0.5) std::swap (u, v);
+            break;
+        default:
+            u = rng (-1e-4, 1e-4);
+            v = rng (0.0, 1.0);
+            if (rng () < 0.5) std::swap (u, v);
+            break;
+        }
+        return tri.v0 + u*(tri.v1 - tri.v0) + v*(tri.v2 - tri.v0);
+    }
+
+    static Ray triangle_ray (Rng& rng, const Triangle& tri, Pattern p) {
+        auto target = triangle_target (rng, tri, p);
+        auto ro = target - rng.direction ()*rng (2.0, 10.0);
+        return {ro, normalize (target - ro)};
+    }
+
+    static Sphere random_sphere (Rng& rng) {
+        auto M = translate (dmat4 (1.0), dvec3 (rng (-5.0, 5.0), rng (-5.0, 5.0), rng (-5.0, 5.0)));
+        M = rotate (M, rng (0.0, 6.28), rng.direction ());
+        M = scale (M, dvec3 (rng (0.2, 2.0), rng (0.2, 2.0), rng (0.2, 2.0)));
+        return {inverse (M), M};
+    }
+
+    static Ray to_world (const Ray& r, const dmat4& T) {
+        auto ro = dvec3 (T*dvec4 (r.ro, 1.0));
+        auto rd = dvec3 (T*dvec4 (r.rd, 0.0));
+        return {ro, normalize (rd)};
+    }
+
+    /* Scene workloads aim from the eye at randomly picked scene primitives,
+       so the hit/miss/grazing mix follows the primitive under test. */
+    static Workload scene_workload (const SceneData& scene, Rng& rng, Pattern p, std::size_t n) {
+        Workload w;
+        auto eye = dvec3 (scene.camera ().eye);
+        auto ntri = scene.triangles ().size ();
+        auto nsph = scene.spheres ().size ();
+        if (ntri + nsph == 0)
+            return w;
+        w.rays.reserve (n);
+        w.tmax.reserve (n);
+        for (auto i = 0u; i < n; ++i) {
+            auto k = std::size_t (rng ()*(ntri + nsph)) % (ntri + nsph);
+            dvec3 target;
+            if (k < ntri) {
+                const auto& t = scene.triangles () [k];
+                target = triangle_target (rng, {dvec3 (t.v0), dvec3 (t.v1), dvec3 (t.v2)}, p);
+            }
+            else {
+                const auto& s = scene.spheres () [k - ntri];
+                auto dir = normalize (dvec3 (s.inverseT*dvec4 (dvec3 (s.T [3]) - eye, 0.0)));
+                target = dvec3 (s.T*dvec4 (unit_sphere_target (rng, dir, p), 1.0));
+            }
+            auto rd = normalize (target - eye);
+            w.rays.push_back ({eye, rd});
+            w.tmax.push_back (length (target - eye)*rng (0.5, 1.5));
+        }
+        return w;
+    }
+
+    /* Rays aimed at a random one of the scene's spheres, each tested 
+       against the leaf of SphereLeaves::WIDTH spheres starting there. */
+    static Workload sphere_leaf_workload (const SceneData& scene, Rng& rng, Pattern p, std::size_t n) {
+        Workload w;
+        auto eye = dvec3 (scene.camera ().eye);
+        auto nsph = scene.spheres ().size ();
+        if (nsph < SphereLeaves::WIDTH)
+            return w;
+        for (auto i = 0u; i < n; ++i) {
+            auto k = std::size_t (rng ()*(nsph - SphereLeaves::WIDTH + 1u)) % (nsph - SphereLeaves::WIDTH + 1u);
+            const auto& s = scene.spheres () [k];
+            auto dir = normalize (dvec3 (s.inverseT*dvec4 (dvec3 (s.T [3]) - eye, 0.0)));
+            auto target = dvec3 (s.T*dvec4 (unit_sphere_target (rng, dir, p), 1.0));
+            w.rays.push_back ({eye, normalize (target - eye)});
+            w.first.push_back (std::uint32_t (k));
+        }
+        return w;
+    }
+
+    static double time_variant (Core& core, const Bench& b, const Variant& v, std::vector<Result>& out) {
+        using clock = std::chrono::high_resolution_clock;
+        auto reps = 0u;
+        auto start = clock::now ();
+        auto elapsed = 0.0;
+        do {
+            v.run (core, b.work, out);
+            ++reps;
+            elapsed = std::chrono::duration<double> (clock::now () - start).count ();
+        } while (elapsed < 0.25);
+        return 1e9*elapsed/(double (reps)*b.work.rays.size ());
+    }
+
+    static double time_variant_parallel (Core& core, const Bench& b, const Variant& v) {
+        using clock = std::chrono::high_resolution_clock;
+        auto start = clock::now ();
+        #pragma omp parallel
+        {
+            std::vector<Result> local;
+            v.run (core, b.work, local);
+        }
+        auto elapsed = std::chrono::duration<double> (clock::now () - start).count ();
+        return 1e9*elapsed/double (b.work.rays.size ());
+    }
+
+    static void check (const char* name, const std::vector<Result>& ref, const std::vector<Result>& res) {
+        auto hit_mismatch = 0u;
+        auto t_mismatch = 0u;
+        for (auto i = 0u; i < ref.size (); ++i) {
+            if (ref [i].hit != res [i].hit) {
+                ++hit_mismatch;
+                continue;
+            }
+            if (ref [i].hit && std::abs (ref [i].t - res [i].t) > 1e-6*std::max (1.0, std::abs (ref [i].t)))
+                ++t_mismatch;
+        }
+        if (hit_mismatch || t_mismatch)
+            std::printf ("    !! %s disagrees with reference: %u hit, %u distance mismatches\n",
+                name, hit_mismatch, t_mismatch);
+    }
+
+}
+
+static std::vector<Variant> canonical_sphere_variants () {
+    return {
+        {"scalar", [] (Core& core, const Workload& w, std::vector<Result>& out) {
+            out.resize (w.rays.size ());
+            for (auto i = 0u; i < w.rays.size (); ++i)
+                out [i].hit = core.canonical_sphere_intersect (w.rays [i].ro, w.rays [i].rd, out [i].t);
+        }}
+    };
+}
+
+static std::vector<Variant> canonical_polygon_variants () {
+    return {
+        {"scalar", [] (Core& core, const Workload& w, std::vector<Result>& out) {
+            out.resize (w.rays.size ());
+            for (auto i = 0u; i < w.rays.size (); ++i) {
+                const auto& t = w.triangles [i];
+                out [i].hit = core.canonical_polygon_intersect (w.rays [i].ro, w.rays [i].rd, t.v0, t.v1, t.v2, out [i].t);
+            }
+        }}
+    };
+}
+
+static std::vector<Variant> sphere_variants () {
+    return {
+        {"scalar", [] (Core& core, const Workload& w, std::vector<Result>& out) {
+            out.resize (w.rays.size ());
+            Core::Incident ii;
+            for (auto i = 0u; i < w.rays.size (); ++i) {
+                const auto& s = w.spheres [i];
+                out [i].hit = core.sphere_intersect (w.rays [i].ro, w.rays [i].rd, s.invT, s.T, ii);
+                out [i].t = ii.t;
+            }
+        }},
+        {"scalar-simple", [] (Core& core, const Workload& w, std::vector<Result>& out) {
+            out.resize (w.rays.size ());
+            for (auto i = 0u; i < w.rays.size (); ++i) {
+                const auto& s = w.spheres [i];
+                out [i].hit = core.simple_sphere_intersect (w.rays [i].ro, w.rays [i].rd, s.invT, s.T, out [i].t);
+            }
+        }}
+    };
+}
+
+/* Nearest hit in each ray's leaf, one sphere at a time and as a batch.
+   The batch is left out when the scene's spheres aren't all round. */
+static std::vector<Variant> sphere_leaf_variants (const SceneData& scene) {
+    static const auto width = SphereLeaves::WIDTH;
+    auto triangles = std::uint32_t (scene.triangle_count ());
+    std::vector<std::uint32_t> order;
+    for (auto i = 0u; i < scene.spheres ().size (); ++i)
+        order.push_back (triangles + i);
+    auto leaves = std::make_shared<SphereLeaves> ();
+    leaves->build (scene, order);
+    auto round = !leaves->empty ();
+    for (auto i = 0u; i < order.size () && round; i += width)
+        round = leaves->round (i, unsigned (std::min<std::size_t> (width, order.size () - i))) 
+            == (1u << std::min<std::size_t> (width, order.size () - i)) - 1u;
+
+    std::vector<Variant> variants;
+    const auto* spheres = &scene.spheres ();
+    variants.push_back ({"scalar", [spheres] (Core& core, const Workload& w, std::vector<Result>& out) {
+        out.resize (w.rays.size ());
+        for (auto i = 0u; i < w.rays.size (); ++i) {
+            out [i].hit = false;
+            for (auto k = w.first [i]; k < w.first [i] + width; ++k) {
+                const auto& s = (*spheres) [k];
+                double t;
+                if (core.simple_sphere_intersect (w.rays [i].ro, w.rays [i].rd, s.inverseT, s.T, t) 
+                    && t > 0.0 && (!out [i].hit || t < out [i].t))
+                {
+                    out [i].hit = true;
+                    out [i].t = t;
+                }
+            }
+        }
+    }});
+    if (round)
+        variants.push_back ({"batch", [leaves] (Core&, const Workload& w, std::vector<Result>& out) {
+            out.resize (w.rays.size ());
+            for (auto i = 0u; i < w.rays.size (); ++i) {
+                double t [width];
+                auto hits = leaves->intersect (w.first [i], w.rays [i].ro, w.rays [i].rd, 0.0, 1e300, t);
+                out [i].hit = hits != 0u;
+                out [i].t = 0.0;
+                for (auto k = 0u; k < width; ++k)
+                    if ((hits >> k & 1u) && (out [i].t == 0.0 || t [k] < out [i].t))
+                        out [i].t = t [k];
+            }
+        }});
+    return variants;
+}
+
+/* One Core per hierarchy width, one with a grid and one testing spheres
+   one at a time, the Core passed in is ignored. */
+static std::vector<std::pair<std::string, CoreOptions>> accelerators () {
+    std::vector<std::pair<std::string, CoreOptions>> out;
+    for (auto width: {2u, 4u, 8u}) {
+        CoreOptions options;
+        options.bvh_width = width;
+        out.push_back ({"bvh" + std::to_string (width), options});
+    }
+    CoreOptions grid;
+    grid.accelerator = Accelerator::grid;
+    out.push_back ({"grid", grid});
+    CoreOptions single;
+    single.sphere_leaves = false;
+    out.push_back ({"bvh4-single", single});
+    return out;
+}
+
+static std::vector<Variant> closest_hit_variants (const SceneData& scene) {
+    std::vector<Variant> variants;
+    for (const auto& a: accelerators ()) {
+        auto own = std::make_shared<Core> (scene, a.second);
+        variants.push_back ({a.first, [own] (Core&, const Workload& w, std::vector<Result>& out) {
+            out.resize (w.rays.size ());
+            Core::Incident ii;
+            for (auto i = 0u; i < w.rays.size (); ++i) {
+                out [i].hit = own->intersect (w.rays [i].ro, w.rays [i].rd, ii);
+                out [i].t = out [i].hit ? ii.t : 0.0;
+            }
+        }});
+    }
+    return variants;
+}
+
+static std::vector<Variant> any_hit_variants (const SceneData& scene) {
+    std::vector<Variant> variants;
+    for (const auto& a: accelerators ()) {
+        auto own = std::make_shared<Core> (scene, a.second);
+        variants.push_back ({a.first, [own] (Core&, const Workload& w, std::vector<Result>& out) {
+            out.resize (w.rays.size ());
+            for (auto i = 0u; i < w.rays.size (); ++i) {
+                out [i].hit = own->intersect (w.rays [i].ro, w.rays [i].rd, w.tmax [i]);
+                out [i].t = 0.0;
+            }
+        }});
+    }
+    return variants;
+}
+
+int main (int argc, char** argv) try {
+    std::string scene_name = argc > 1 ? argv [1] : "scene5.test";
+    std::size_t count = argc > 2 ? std::strtoul (argv [2], nullptr, 10) : 1u << 18;
+    std::size_t scene_count = count/16;
+
+    SceneData scene;
+    parse (scene, scene_name);
+    Core core (scene);
+
+    Rng rng (0x1275a3c9u);
+    std::vector<Bench> benches;
+    for (auto p: {Pattern::hit, Pattern::miss, Pattern::grazing}) {
+        Bench cs {"canonical_sphere_intersect", p};
+        for (auto i = 0u; i < count; ++i)
+            cs.work.rays.push_back (unit_sphere_ray (rng, p));
+        cs.variants = canonical_sphere_variants ();
+        benches.push_back (std::move (cs));
+
+        Bench cp {"canonical_polygon_intersect", p};
+        for (auto i = 0u; i < count; ++i) {
+            cp.work.triangles.push_back (random_triangle (rng));
+            cp.work.rays.push_back (triangle_ray (rng, cp.work.triangles.back (), p));
+        }
+        cp.variants = canonical_polygon_variants ();
+        benches.push_back (std::move (cp));
+
+        Bench sp {"sphere_intersect", p};
+        for (auto i = 0u; i < count; ++i) {
+            sp.work.spheres.push_back (random_sphere (rng));
+            sp.work.rays.push_back (to_world (unit_sphere_ray (rng, p), sp.work.spheres.back ().T));
+        }
+        sp.variants = sphere_variants ();
+        benches.push_back (std::move (sp));
+
+        Bench sl {"sphere leaf (nearest)", p, sphere_leaf_workload (scene, rng, p, scene_count)};
+        sl.variants = sphere_leaf_variants (scene);
+        benches.push_back (std::move (sl));
+
+        Bench ch {"intersect (closest)", p, scene_workload (scene, rng, p, scene_count)};
+        ch.variants = closest_hit_variants (scene);
+        benches.push_back (std::move (ch));
+
+        Bench ah {"intersect (any, tmax)", p, scene_workload (scene, rng, p, scene_count)};
+        ah.variants = any_hit_variants (scene);
+        benches.push_back (std::move (ah));
+    }
+
+    std::printf ("%s: %zu triangles, %zu spheres, %d threads\n\n",
+        scene_name.c_str (), scene.triangles ().size (), scene.spheres ().size (), omp_get_max_threads ());
+    std::printf ("%-30s %-8s %-14s %12s %14s %14s %8s\n",
+        "kernel", "rays", "variant", "ns/test", "Mtests/s/core", "Mtests/s/all", "hits");
+
+    for (const auto& b: benches) {
+        if (b.work.rays.empty ())
+            continue;
+        std::vector<Result> reference;
+        for (auto i = 0u; i < b.variants.size (); ++i) {
+            const auto& v = b.variants [i];
+            std::vector<Result> results;
+            auto ns = time_variant (core, b, v, results);
+            auto ns_all = time_variant_parallel (core, b, v);
+            auto hits = 0u;
+            for (const auto& r: results)
+                hits += r.hit;
+            std::printf ("%-30s %-8s %-14s %12.2f %14.2f %14.2f %7.1f%%\n",
+                b.name.c_str (), pattern_name (b.pattern), v.name.c_str (), ns, 1e3/ns,
+                1e3*omp_get_max_threads ()/ns_all, 100.0*hits/results.size ());
+            if (i == 0)
+                reference = std::move (results);
+            else
+                check (v.name.c_str (), reference, results);
+        }
+    }
+    return 0;
+}
+catch (std::exception& e) {
+    std::cout << e.what () << "\n";
+    return -1;
+}
@@ -0,0 +1,1390 @@
+#include "Bvh.h"
+#include <omp.h>
+#include <atomic>
+#include <limits>
+#include <algorithm>
+#include <memory>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#ifdef _MSC_VER
+#   include <intrin.h>
+#endif
+
+#if defined (__AVX__)
+#   include <immintrin.h>
+#   define I2T_AVX
+#endif
+#if defined (_M_X64) || defined (__SSE2__)
+#   include <emmintrin.h>
+#   define I2T_SSE2
+#endif
+
+namespace {
+    using namespace i2t;
+
+    /* SAH weights for visiting an inner node and testing a primitive. */
+    static const double COST_INNER = 1.2;
+    static const double COST_LEAF = 1.0;
+    static const unsigned TREELET = 7u;
+
+    /* Share of the whole tree's cost a subtree has to have put on before
+       refit () rebuilds it. Small subtrees mostly get worse when the 
+       primitives of two moving groups drift apart, which no rebuild of 
+       theirs alone can fix. */
+    static const double REBUILD_SHARE = 0.01;
+
+    static int leading_zeros (std::uint64_t v) {
+        if (!v)
+            return 64;
+#ifdef _MSC_VER
+        unsigned long i;
+        _BitScanReverse64 (&i, v);
+        return 63 - int (i);
+#else
+        return __builtin_clzll (v);
+#endif
+    }
+
+    /* Spreads the low 21 bits of v two apart. */
+    static std::uint64_t spread (std::uint64_t v) {
+        v &= 0x1fffffull;
+        v = (v | v << 32) & 0x1f00000000ffffull;
+        v = (v | v << 16) & 0x1f0000ff0000ffull;
+        v = (v | v << 8) & 0x100f00f00f00f00full;
+        v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+        v = (v | v << 2) & 0x1249249249249249ull;
+        return v;
+    }
+
+    /* Exact for the exponents a node can hold, without a call to ldexp. */
+    static double power_of_two (int exponent) {
+        auto bits = std::uint64_t (exponent + 1023) << 52;
+        double value;
+        std::memcpy (&value, &bits, sizeof (value));
+        return value;
+    }
+
+    static double area (const Bounds& b) {
+        auto d = max (b.hi - b.lo, dvec3 (0.0));
+        return 2.0*(d.x*d.y + d.y*d.z + d.z*d.x);
+    }
+
+    static Bounds join (const Bounds& a, const Bounds& b) {
+        return {min (a.lo, b.lo), max (a.hi, b.hi)};
+    }
+
+    /* Padded so hits on a box face aren't lost to rounding. */
+    static Bounds pad (const Bounds& b) {
+        auto d = (abs (b.lo) + abs (b.hi))*1e-9 + 1e-12;
+        return {b.lo - d, b.hi + d};
+    }
+
+    /* Stable LSD radix sort of 63 bit keys, a byte per pass. The keys are
+       cut into one chunk per thread, each chunk counts its digits and then
+       scatters to its own offsets, so equal keys keep their order. Passes
+       where every key has the same digit are skipped. */
+    static void radix_sort (std::vector<std::uint64_t>& keys, std::vector<std::uint32_t>& values) {
+        auto n = int (keys.size ());
+        auto chunks = std::max (1, std::min (omp_get_max_threads (), n/4096 + 1));
+        std::vector<std::uint64_t> keys2 (n);
+        std::vector<std::uint32_t> values2 (n);
+        std::vector<std::size_t> counts (chunks*256u);
+
+        for (auto shift = 0u; shift < 64u; shift += 8u) {
+            std::fill (counts.begin (), counts.end (), 0u);
+            #pragma omp parallel for
+            for (int c = 0; c < chunks; ++c) {
+                auto count = &counts [c*256u];
+                for (auto i = n*std::int64_t (c)/chunks; i < n*std::int64_t (c + 1)/chunks; ++i)
+                    ++count [(keys [i] >> shift) & 255u];
+            }
+            std::size_t sum = 0u;
+            auto uniform = false;
+            for (auto d = 0u; d < 256u; ++d) {
+                auto total = 0u;
+                for (auto c = 0; c < chunks; ++c) {
+                    auto k = counts [c*256u + d];
+                    counts [c*256u + d] = sum;
+                    sum += k;
+                    total += unsigned (k);
+                }
+                uniform = uniform || total == unsigned (n);
+            }
+            if (uniform)
+                continue;
+            #pragma omp parallel for
+            for (int c = 0; c < chunks; ++c) {
+                auto offset = &counts [c*256u];
+                for (auto i = n*std::int64_t (c)/chunks; i < n*std::int64_t (c + 1)/chunks; ++i) {
+                    auto& o = offset [(keys [i] >> shift) & 255u];
+                    keys2 [o] = keys [i];
+                    values2 [o] = values [i];
+                    ++o;
+                }
+            }
+            std::swap (keys, keys2);
+            std::swap (values, values2);
+        }
+    }
+
+    /* Binary tree as emitted by the builder: inner nodes 0..n-2 with the
+       root at 0, then the n leaves in Morton order. cost is the SAH cost
+       of the subtree, already the cheaper of splitting or making a leaf
+       of it where that's allowed. */
+    struct Tree {
+        std::uint32_t leaves;
+        std::vector<std::uint32_t> left, right, parent, count;
+        std::vector<Bounds> bounds;
+        std::vector<double> cost;
+
+        bool leaf (std::uint32_t i) const { return i + 1u >= leaves; }
+
+        void update (std::uint32_t i) {
+            auto l = left [i], r = right [i];
+            bounds [i] = join (bounds [l], bounds [r]);
+            count [i] = count [l] + count [r];
+            cost [i] = COST_INNER*area (bounds [i]) + cost [l] + cost [r];
+            if (count [i] <= Bvh::MAX_LEAF)
+                cost [i] = std::min (cost [i], COST_LEAF*area (bounds [i])*count [i]);
+        }
+
+        bool collapse (std::uint32_t i) const {
+            if (leaf (i))
+                return true;
+            return count [i] <= Bvh::MAX_LEAF
+                && COST_LEAF*area (bounds [i])*count [i] <= COST_INNER*area (bounds [i]) + cost [left [i]] + cost [right [i]];
+        }
+    };
+
+    /* Karras 2012: the range of leaves under each inner node and where it
+       splits follow from the common prefixes of the sorted codes alone, so
+       every inner node is found independently. Codes carry the index in
+       their low bits where they'd otherwise repeat. */
+    static void emit (Tree& tree, const std::vector<std::uint64_t>& codes) {
+        auto n = int (codes.size ());
+        auto delta = [&] (int i, int j) {
+            if (j < 0 || j >= n)
+                return -1;
+            if (codes [i] == codes [j])
+                return 64 + leading_zeros (std::uint64_t (i ^ j) << 32);
+            return leading_zeros (codes [i] ^ codes [j]);
+        };
+        #pragma omp parallel for
+        for (int i = 0; i < n - 1; ++i) {
+            auto d = delta (i, i + 1) > delta (i, i - 1) ? 1 : -1;
+            auto dmin = delta (i, i - d);
+            auto lmax = 2;
+            while (delta (i, i + lmax*d) > dmin)
+                lmax *= 2;
+            auto l = 0;
+            for (auto t = lmax/2; t >= 1; t /= 2)
+                if (delta (i, i + (l + t)*d) > dmin)
+                    l += t;
+            auto j = i + l*d;
+            auto dnode = delta (i, j);
+            auto s = 0;
+            for (auto t = l; t > 1;) {
+                t = (t + 1)/2;
+                if (delta (i, i + (s + t)*d) > dnode)
+                    s += t;
+            }
+            auto split = i + s*d + std::min (d, 0);
+            auto first = std::min (i, j), last = std::max (i, j);
+            tree.left [i] = split == first ? std::uint32_t (split + n - 1) : std::uint32_t (split);
+            tree.right [i] = split + 1 == last ? std::uint32_t (split + n) : std::uint32_t (split + 1);
+            tree.parent [tree.left [i]] = std::uint32_t (i);
+            tree.parent [tree.right [i]] = std::uint32_t (i);
+        }
+    }
+
+    /* Exhaustive search over the ways of joining the leaves of a small
+       treelet, by dynamic programming over subsets. The treelet's inner
+       nodes are reused for the new shape, so no allocation is needed. */
+    struct Treelet {
+        Tree& tree;
+        std::uint32_t leaves [TREELET];
+        std::uint32_t inner [TREELET - 1u];
+        unsigned nleaves = 0u, ninner = 0u, next = 0u;
+        Bounds bounds [1u << TREELET];
+        double best [1u << TREELET];
+        std::uint32_t split [1u << TREELET];
+        std::uint32_t count [1u << TREELET];
+
+        explicit Treelet (Tree& t): tree (t) {}
+
+        bool optimize (std::uint32_t root) {
+            nleaves = ninner = next = 0u;
+            inner [ninner++] = root;
+            leaves [nleaves++] = tree.left [root];
+            leaves [nleaves++] = tree.right [root];
+            while (nleaves < TREELET) {
+                auto pick = nleaves;
+                auto largest = -1.0;
+                for (auto i = 0u; i < nleaves; ++i) {
+                    if (tree.leaf (leaves [i]))
+                        continue;
+                    auto a = area (tree.bounds [leaves [i]]);
+                    if (a > largest) {
+                        largest = a;
+                        pick = i;
+                    }
+                }
+                if (pick == nleaves)
+                    break;
+                auto node = leaves [pick];
+                inner [ninner++] = node;
+                leaves [pick] = tree.left [node];
+                leaves [nleaves++] = tree.right [node];
+            }
+            if (nleaves < 3u)
+                return false;
+
+            auto full = (1u << nleaves) - 1u;
+            for (auto s = 1u; s <= full; ++s) {
+                auto low = s & (0u - s);
+                auto i = 0u;
+                while ((1u << i) != low)
+                    ++i;
+                if (s == low) {
+                    bounds [s] = tree.bounds [leaves [i]];
+                    count [s] = tree.count [leaves [i]];
+                    best [s] = tree.cost [leaves [i]];
+                    continue;
+                }
+                bounds [s] = join (bounds [low], bounds [s ^ low]);
+                count [s] = count [low] + count [s ^ low];
+                auto cheapest = std::numeric_limits<double>::infinity ();
+                auto rest = s ^ low;
+                for (auto q = rest;; q = (q - 1u) & rest) {
+                    auto p = low | q;
+                    if (p != s && best [p] + best [s ^ p] < cheapest) {
+                        cheapest = best [p] + best [s ^ p];
+                        split [s] = p;
+                    }
+                    if (!q)
+                        break;
+                }
+                best [s] = COST_INNER*area (bounds [s]) + cheapest;
+                if (count [s] <= Bvh::MAX_LEAF)
+                    best [s] = std::min (best [s], COST_LEAF*area (bounds [s])*count [s]);
+            }
+            if (best [full] >= tree.cost [root]*(1.0 - 1e-9))
+                return false;
+            rebuild (full);
+            return true;
+        }
+
+        std::uint32_t rebuild (std::uint32_t s) {
+            if (!(s & (s - 1u))) {
+                auto i = 0u;
+                while ((1u << i) != s)
+                    ++i;
+                return leaves [i];
+            }
+            auto node = inner [next++];
+            auto l = rebuild (split [s]);
+            auto r = rebuild (s ^ split [s]);
+            tree.left [node] = l;
+            tree.right [node] = r;
+            tree.parent [l] = node;
+            tree.parent [r] = node;
+            tree.update (node);
+            return node;
+        }
+    };
+
+    /* Walks up from every leaf at once. The first thread to reach a node
+       stops, the second finds both children done and handles the node, so
+       each node is visited once and only after its whole subtree. */
+    template <typename _Visit>
+    static void bottom_up (Tree& tree, _Visit&& visit) {
+        auto n = int (tree.leaves);
+        std::unique_ptr<std::atomic<std::uint32_t> []> arrived (new std::atomic<std::uint32_t> [n]);
+        for (auto i = 0; i < n; ++i)
+            arrived [i] = 0u;
+        #pragma omp parallel for
+        for (int i = 0; i < n; ++i) {
+            auto node = std::uint32_t (i + n - 1);
+            while (node != 0u) {
+                node = tree.parent [node];
+                if (arrived [node].fetch_add (1u) == 0u)
+                    break;
+                visit (node);
+            }
+        }
+    }
+
+    /* Levels of splits a balanced tree needs to bring count primitives
+       down to leaves of MAX_LEAF. */
+    static unsigned levels (std::uint32_t count) {
+        auto k = 0u;
+        while ((std::uint64_t (Bvh::MAX_LEAF) << k) < count)
+            ++k;
+        return k;
+    }
+
+    /* Lays out the tree leaves from first to last as a balanced subtree,
+       halving the run at each level, so it's levels () deep. */
+    static void balance (const Tree& tree, const std::vector<std::uint32_t>& order, 
+        const std::uint32_t* first, const std::uint32_t* last,
+        std::vector<Bvh::Node>& nodes, std::vector<std::uint32_t>& primitives)
+    {
+        auto slot = nodes.size ();
+        auto box = tree.bounds [*first];
+        for (auto i = first + 1; i < last; ++i)
+            box = join (box, tree.bounds [*i]);
+        nodes.push_back ({box.lo, box.hi, 0u, 0u});
+        if (std::uint32_t (last - first) <= Bvh::MAX_LEAF) {
+            nodes [slot].offset = std::uint32_t (primitives.size ());
+            nodes [slot].count = std::uint32_t (last - first);
+            for (auto i = first; i < last; ++i)
+                primitives.push_back (order [*i + 1u - tree.leaves]);
+            return;
+        }
+        auto middle = first + (last - first)/2;
+        balance (tree, order, first, middle, nodes, primitives);
+        nodes [slot].offset = std::uint32_t (nodes.size ());
+        balance (tree, order, middle, last, nodes, primitives);
+    }
+
+    /* Fits the tree to its leaves, runs the treelet passes and lays it
+       out depth first, folding small subtrees into leaves where the SAH
+       says so. order gives the primitive of each leaf. depth is where 
+       the root will sit in the whole hierarchy: a subtree that couldn't
+       go one level further and still be balanced within MAX_DEPTH is
+       balanced from there on, which caps the unbalanced chains Morton 
+       codes and spatial splits can give. */
+    static void finish (Tree& tree, int passes, const std::vector<std::uint32_t>& order,
+        std::vector<Bvh::Node>& nodes, std::vector<std::uint32_t>& primitives, unsigned depth)
+    {
+        bottom_up (tree, [&] (std::uint32_t node) { tree.update (node); });
+        for (auto pass = 0; pass < passes; ++pass) {
+            bottom_up (tree, [&] (std::uint32_t node) {
+                if (tree.count [node] < TREELET || !Treelet (tree).optimize (node))
+                    tree.update (node);
+            });
+        }
+
+        nodes.reserve (2*tree.leaves - 1u);
+        primitives.reserve (tree.leaves);
+        struct Entry {
+            std::uint32_t node, patch, depth;
+        };
+        std::vector<Entry> stack (1u, {0u, ~0u, depth});
+        std::vector<std::uint32_t> gather, run;
+        while (!stack.empty ()) {
+            auto e = stack.back ();
+            auto node = e.node;
+            stack.pop_back ();
+            auto slot = std::uint32_t (nodes.size ());
+            if (e.patch != ~0u)
+                nodes [e.patch].offset = slot;
+            auto split = !tree.collapse (node);
+            if (split && e.depth + 1u + levels (tree.count [node]) > Bvh::MAX_DEPTH) {
+                run.clear ();
+                gather.assign (1u, node);
+                while (!gather.empty ()) {
+                    auto i = gather.back ();
+                    gather.pop_back ();
+                    if (tree.leaf (i))
+                        run.push_back (i);
+                    else {
+                        gather.push_back (tree.right [i]);
+                        gather.push_back (tree.left [i]);
+                    }
+                }
+                balance (tree, order, run.data (), run.data () + run.size (), nodes, primitives);
+                continue;
+            }
+            nodes.push_back ({tree.bounds [node].lo, tree.bounds [node].hi, 0u, 0u});
+            if (split) {
+                stack.push_back ({tree.right [node], slot, e.depth + 1u});
+                stack.push_back ({tree.left [node], ~0u, e.depth + 1u});
+                continue;
+            }
+            nodes [slot].offset = std::uint32_t (primitives.size ());
+            gather.assign (1u, node);
+            while (!gather.empty ()) {
+                auto i = gather.back ();
+                gather.pop_back ();
+                if (tree.leaf (i))
+                    primitives.push_back (order [i + 1u - tree.leaves]);
+                else {
+                    gather.push_back (tree.right [i]);
+                    gather.push_back (tree.left [i]);
+                }
+            }
+            nodes [slot].count = std::uint32_t (primitives.size ()) - nodes [slot].offset;
+        }
+    }
+
+    /* Top down SAH build over references, which are a primitive and the
+       part of its box on one side of every spatial split above. Each node
+       tries the best binned object split, and where its two halves would 
+       overlap noticeably also the best spatial split, which clips the 
+       references straddling the plane into both halves while the budget
+       of extra references lasts. Straddlers go to one side only when that
+       is as cheap, as in Stich et al. 2009. The result goes through the
+       same treelet passes as high, which pick the leaf sizes. */
+    struct SpatialBuilder {
+        static const unsigned BINS = 32u;
+        static const unsigned MAX_DEPTH = 64u;
+
+        struct Reference {
+            Bounds box;
+            std::uint32_t primitive;
+        };
+
+        struct Split {
+            double cost = std::numeric_limits<double>::infinity ();
+            int axis = -1;
+            unsigned bin = 0u;
+            double plane = 0.0;
+            double origin = 0.0, scale = 0.0;
+
+            unsigned bin_of (const Reference& r) const {
+                auto c = (r.box.lo [axis] + r.box.hi [axis])*0.5;
+                return std::min (BINS - 1u, unsigned ((c - origin)*scale));
+            }
+            Bounds left, right;
+        };
+
+        static const std::uint32_t LEAF = 1u << 31;
+
+        SpatialBuilder (const SceneData* scene, std::size_t budget, double min_overlap):
+            scene (scene),
+            budget (budget),
+            min_overlap (min_overlap)
+        {}
+
+        const SceneData* scene;
+        std::size_t budget;
+        double min_overlap;
+        std::vector<std::uint32_t> left, right;
+        std::vector<Reference> leaves;
+
+        /* Bounds of the primitive's part inside the slab, within its
+           reference box. Triangles are clipped edge by edge, anything else
+           keeps the box. */
+        Bounds clip (const Reference& r, int axis, double s0, double s1) const {
+            auto b = r.box;
+            b.lo [axis] = std::max (b.lo [axis], s0);
+            b.hi [axis] = std::min (b.hi [axis], s1);
+            if (!scene || r.primitive >= scene->triangles ().size ())
+                return b;
+            const auto& t = scene->triangles () [r.primitive];
+            dvec3 v [3] = {dvec3 (t.v0), dvec3 (t.v1), dvec3 (t.v2)};
+            Bounds c = {dvec3 (std::numeric_limits<double>::max ()), dvec3 (-std::numeric_limits<double>::max ())};
+            for (auto i = 0; i < 3; ++i) {
+                const auto& p = v [i];
+                const auto& q = v [(i + 1)%3];
+                if (p [axis] >= s0 && p [axis] <= s1)
+                    c = join (c, {p, p});
+                for (auto s: {s0, s1}) {
+                    if ((p [axis] - s)*(q [axis] - s) < 0.0) {
+                        auto x = p + (q - p)*((s - p [axis])/(q [axis] - p [axis]));
+                        x [axis] = s;
+                        c = join (c, {x, x});
+                    }
+                }
+            }
+            c = pad (c);
+            return {max (c.lo, b.lo), min (c.hi, b.hi)};
+        }
+
+        Split object_split (const std::vector<Reference>& refs) const {
+            Split best;
+            Bounds centroids = {dvec3 (std::numeric_limits<double>::max ()), dvec3 (-std::numeric_limits<double>::max ())};
+            for (const auto& r: refs) {
+                auto c = (r.box.lo + r.box.hi)*0.5;
+                centroids = join (centroids, {c, c});
+            }
+            for (auto axis = 0; axis < 3; ++axis) {
+                auto extent = centroids.hi [axis] - centroids.lo [axis];
+                if (extent <= 0.0)
+                    continue;
+                Bounds bins [BINS];
+                unsigned counts [BINS] = {};
+                for (auto& b: bins)
+                    b = {dvec3 (std::numeric_limits<double>::max ()), dvec3 (-std::numeric_limits<double>::max ())};
+                Split binning;
+                binning.axis = axis;
+                binning.origin = centroids.lo [axis];
+                binning.scale = BINS/extent;
+                for (const auto& r: refs) {
+                    auto k = binning.bin_of (r);
+                    bins [k] = join (bins [k], r.box);
+                    ++counts [k];
+                }
+                auto before = best.axis;
+                sweep (bins, counts, counts, axis, best);
+                if (best.axis != before) {
+                    best.origin = binning.origin;
+                    best.scale = binning.scale;
+                }
+            }
+            return best;
+        }
+
+        Split spatial_split (const std::vector<Reference>& refs, const Bounds& box) const {
+            Split best;
+            for (auto axis = 0; axis < 3; ++axis) {
+                auto lo = box.lo [axis];
+                auto width = (box.hi [axis] - lo)/BINS;
+                if (width <= 0.0)
+                    continue;
+                Bounds bins [BINS];
+                unsigned entries [BINS] = {}, exits [BINS] = {};
+                for (auto& b: bins)
+                    b = {dvec3 (std::numeric_limits<double>::max ()), dvec3 (-std::numeric_limits<double>::max ())};
+                for (const auto& r: refs) {
+                    auto first = std::min (BINS - 1u, unsigned (std::max (0.0, (r.box.lo [axis] - lo)/width)));
+                    auto last = std::min (BINS - 1u, unsigned (std::max (0.0, (r.box.hi [axis] - lo)/width)));
+                    ++entries [first];
+                    ++exits [last];
+                    for (auto k = first; k <= last; ++k) {
+                        auto s0 = k == first ? -std::numeric_limits<double>::max () : lo + k*width;
+                        auto s1 = k == last ? std::numeric_limits<double>::max () : lo + (k + 1u)*width;
+                        bins [k] = join (bins [k], clip (r, axis, s0, s1));
+                    }
+                }
+                auto before = best.axis;
+                sweep (bins, entries, exits, axis, best);
+                if (best.axis != before)
+                    best.plane = lo + width*(best.bin + 1u);
+            }
+            return best;
+        }
+
+        /* Cost of cutting after each bin, counting references that start
+           left of the cut on the left and ones that end right of it on the
+           right. The same sweep serves object splits with both counts the
+           same. */
+        static void sweep (const Bounds* bins, const unsigned* left_counts, const unsigned* right_counts, int axis, Split& best) {
+            Bounds right [BINS];
+            unsigned nright [BINS];
+            auto acc = bins [BINS - 1u];
+            auto n = right_counts [BINS - 1u];
+            for (auto k = BINS - 1u; k > 0u; --k) {
+                right [k] = acc;
+                nright [k] = n;
+                acc = join (acc, bins [k - 1u]);
+                n += right_counts [k - 1u];
+            }
+            auto left = bins [0];
+            auto nleft = left_counts [0];
+            for (auto k = 0u; k + 1u < BINS; ++k) {
+                if (nleft && nright [k + 1u]) {
+                    auto cost = COST_LEAF*(area (left)*nleft + area (right [k + 1u])*nright [k + 1u]);
+                    if (cost < best.cost) {
+                        best.cost = cost;
+                        best.axis = axis;
+                        best.bin = k;
+                        best.left = left;
+                        best.right = right [k + 1u];
+                    }
+                }
+                left = join (left, bins [k + 1u]);
+                nleft += left_counts [k + 1u];
+            }
+        }
+
+        /* Splits down to single references, leaving leaf sizes to the
+           treelet passes and the layout. Returns the inner node made or
+           LEAF with the reference's index. */
+        std::uint32_t build (std::vector<Reference>& refs, unsigned depth) {
+            auto n = refs.size ();
+            if (n == 1u) {
+                leaves.push_back (refs.front ());
+                return LEAF | std::uint32_t (leaves.size () - 1u);
+            }
+            auto slot = std::uint32_t (left.size ());
+            left.push_back (0u);
+            right.push_back (0u);
+
+            auto box = refs.front ().box;
+            for (const auto& r: refs)
+                box = join (box, r.box);
+            auto split = depth < MAX_DEPTH ? object_split (refs) : Split ();
+            auto spatial = false;
+            if (split.axis >= 0 && budget > 0u) {
+                auto overlap = Bounds {max (split.left.lo, split.right.lo), min (split.left.hi, split.right.hi)};
+                if (all (lessThan (overlap.lo, overlap.hi)) && area (overlap) > min_overlap) {
+                    auto s = spatial_split (refs, box);
+                    if (s.cost < split.cost) {
+                        split = s;
+                        spatial = true;
+                    }
+                }
+            }
+
+            std::vector<Reference> l, r;
+            auto axis = split.axis;
+            auto plane = split.plane;
+            if (axis < 0) {
+                /* Nothing to bin on or deep enough, halve the list. */
+            }
+            else if (!spatial) {
+                /* Same bin arithmetic as object_split so the halves are the
+                   ones it costed. */
+                for (const auto& ref: refs)
+                    (split.bin_of (ref) <= split.bin ? l : r).push_back (ref);
+            }
+            else {
+                auto nl = 0.0, nr = 0.0;
+                for (const auto& ref: refs) {
+                    nl += ref.box.lo [axis] < plane;
+                    nr += ref.box.hi [axis] > plane;
+                }
+                auto al = area (split.left), ar = area (split.right);
+                for (const auto& ref: refs) {
+                    if (ref.box.hi [axis] <= plane)
+                        l.push_back (ref);
+                    else if (ref.box.lo [axis] >= plane)
+                        r.push_back (ref);
+                    else {
+                        auto both = al*nl + ar*nr;
+                        auto to_left = area (join (split.left, ref.box))*nl + ar*(nr - 1.0);
+                        auto to_right = al*(nl - 1.0) + area (join (split.right, ref.box))*nr;
+                        if (budget > 0u && both < to_left && both < to_right) {
+                            l.push_back ({clip (ref, axis, -std::numeric_limits<double>::max (), plane), ref.primitive});
+                            r.push_back ({clip (ref, axis, plane, std::numeric_limits<double>::max ()), ref.primitive});
+                            --budget;
+                        }
+                        else if (to_left <= to_right) {
+                            l.push_back (ref);
+                            nr -= 1.0;
+                        }
+                        else {
+                            r.push_back (ref);
+                            nl -= 1.0;
+                        }
+                    }
+                }
+            }
+            if (l.empty () || r.empty ()) {
+                l.assign (refs.begin (), refs.begin () + n/2);
+                r.assign (refs.begin () + n/2, refs.end ());
+            }
+            std::vector<Reference> ().swap (refs);
+            auto child = build (l, depth + 1u);
+            left [slot] = child;
+            child = build (r, depth + 1u);
+            right [slot] = child;
+            return slot;
+        }
+    };
+}
+
+i2t::Bounds i2t::Bvh::primitive_bounds (const SceneData& scene, std::uint32_t primitive) {
+    auto triangles = std::uint32_t (scene.triangle_count ());
+    auto released = triangles - std::uint32_t (scene.triangles ().size ());
+    if (primitive < triangles) {
+        const auto& t = scene.triangles ().at (primitive - released);
+        auto v0 = dvec3 (t.v0), v1 = dvec3 (t.v1), v2 = dvec3 (t.v2);
+        return pad ({min (v0, min (v1, v2)), max (v0, max (v1, v2))});
+    }
+    /* The unit sphere under T reaches as far along each axis as the
+       length of that row of T. */
+    const auto& T = scene.spheres () [primitive - triangles].T;
+    auto c = dvec3 (T [3]);
+    auto e = sqrt (dvec3 (
+        T [0][0]*T [0][0] + T [1][0]*T [1][0] + T [2][0]*T [2][0],
+        T [0][1]*T [0][1] + T [1][1]*T [1][1] + T [2][1]*T [2][1],
+        T [0][2]*T [0][2] + T [1][2]*T [1][2] + T [2][2]*T [2][2]));
+    return pad ({c - e, c + e});
+}
+
+/* Spilled triangles are read back a chunk at a time, which is all the
+   build needs of them. */
+std::vector<i2t::Bounds> i2t::Bvh::primitive_bounds (const SceneData& scene) {
+    static const int CHUNK = 4096;
+    auto n = int (scene.triangle_count () + scene.spheres ().size ());
+    auto released = int (scene.triangle_count () - scene.triangles ().size ());
+    std::vector<Bounds> bounds (n);
+    #pragma omp parallel for
+    for (int i = released; i < n; ++i)
+        bounds [i] = primitive_bounds (scene, std::uint32_t (i));
+    std::vector<dvec3> v (3u*CHUNK);
+    for (auto first = 0; first < released; first += CHUNK) {
+        auto count = std::min (CHUNK, released - first);
+        if (!scene.read_spill (first, count, v.data ()))
+            throw std::runtime_error ("Couldn't read back " + scene.spill ());
+        #pragma omp parallel for
+        for (int i = 0; i < count; ++i) {
+            const auto* t = &v [3*i];
+            bounds [first + i] = pad ({min (t [0], min (t [1], t [2])), max (t [0], max (t [1], t [2]))});
+        }
+    }
+    return bounds;
+}
+
+void i2t::Bvh::build (const SceneData& scene, BvhQuality quality, double duplication) {
+    if (quality == BvhQuality::spatial)
+        build_spatial (primitive_bounds (scene), &scene, duplication, 0u);
+    else
+        build_linear (primitive_bounds (scene), quality, 0u);
+}
+
+void i2t::Bvh::build (const std::vector<Bounds>& input, BvhQuality quality) {
+    if (quality == BvhQuality::spatial)
+        build_spatial (input, nullptr, 0.25, 0u);
+    else
+        build_linear (input, quality, 0u);
+}
+
+/* Duplicates can leave too many references to balance within what's 
+   left of MAX_DEPTH below depth, the build is then done without them. */
+void i2t::Bvh::build_spatial (const std::vector<Bounds>& input, const SceneData* scene, double duplication,
+    unsigned depth)
+{
+    $nodes.clear ();
+    $primitives.clear ();
+    $parents.clear ();
+    $quality = BvhQuality::spatial;
+    if (input.empty ())
+        return;
+    std::vector<SpatialBuilder::Reference> refs;
+    refs.reserve (input.size ());
+    auto box = input.front ();
+    for (auto i = 0u; i < input.size (); ++i) {
+        refs.push_back ({input [i], std::uint32_t (i)});
+        box = join (box, input [i]);
+    }
+    SpatialBuilder builder (scene, std::size_t (std::max (0.0, duplication)*input.size ()), 1e-5*area (box));
+    builder.build (refs, 0u);
+
+    auto n = std::uint32_t (builder.leaves.size ());
+    if (depth + levels (n) > MAX_DEPTH)
+        return build_linear (input, BvhQuality::high, depth);
+    auto index = [n] (std::uint32_t child) {
+        return child & SpatialBuilder::LEAF ? (child & ~SpatialBuilder::LEAF) + n - 1u : child;
+    };
+    Tree tree;
+    tree.leaves = n;
+    tree.left.resize (n - 1u);
+    tree.right.resize (n - 1u);
+    tree.parent.assign (2u*n - 1u, 0u);
+    tree.count.assign (2u*n - 1u, 1u);
+    tree.bounds.resize (2u*n - 1u);
+    tree.cost.resize (2u*n - 1u);
+    for (auto i = 0u; i + 1u < n; ++i) {
+        tree.left [i] = index (builder.left [i]);
+        tree.right [i] = index (builder.right [i]);
+        tree.parent [tree.left [i]] = i;
+        tree.parent [tree.right [i]] = i;
+    }
+    std::vector<std::uint32_t> order (n);
+    for (auto i = 0u; i < n; ++i) {
+        auto leaf = i + n - 1u;
+        tree.bounds [leaf] = builder.leaves [i].box;
+        tree.cost [leaf] = COST_LEAF*area (tree.bounds [leaf]);
+        order [i] = builder.leaves [i].primitive;
+    }
+    finish (tree, 3, order, $nodes, $primitives, depth);
+}
+
+void i2t::Bvh::build_linear (const std::vector<Bounds>& input, BvhQuality quality, unsigned depth) {
+    $nodes.clear ();
+    $primitives.clear ();
+    $parents.clear ();
+    $quality = quality;
+    auto n = int (input.size ());
+    if (!n)
+        return;
+
+    /* Centroids are quantized to 21 bits per axis over their bounds. */
+    auto lo = dvec3 (std::numeric_limits<double>::max ());
+    auto hi = -lo;
+    for (const auto& b: input) {
+        lo = min (lo, (b.lo + b.hi)*0.5);
+        hi = max (hi, (b.lo + b.hi)*0.5);
+    }
+    auto scale = 2097151.0/max (hi - lo, dvec3 (1e-300));
+    std::vector<std::uint64_t> codes (n);
+    std::vector<std::uint32_t> order (n);
+    #pragma omp parallel for
+    for (int i = 0; i < n; ++i) {
+        auto q = clamp ((((input [i].lo + input [i].hi)*0.5) - lo)*scale, dvec3 (0.0), dvec3 (2097151.0));
+        codes [i] = spread (std::uint64_t (q.x)) << 2 | spread (std::uint64_t (q.y)) << 1 | spread (std::uint64_t (q.z));
+        order [i] = std::uint32_t (i);
+    }
+    radix_sort (codes, order);
+
+    Tree tree;
+    tree.leaves = std::uint32_t (n);
+    tree.left.resize (n - 1);
+    tree.right.resize (n - 1);
+    tree.parent.assign (2*n - 1, 0u);
+    tree.count.resize (2*n - 1);
+    tree.bounds.resize (2*n - 1);
+    tree.cost.resize (2*n - 1);
+    emit (tree, codes);
+
+    #pragma omp parallel for
+    for (int i = 0; i < n; ++i) {
+        auto leaf = i + n - 1;
+        tree.bounds [leaf] = input [order [i]];
+        tree.count [leaf] = 1u;
+        tree.cost [leaf] = COST_LEAF*area (tree.bounds [leaf]);
+    }
+
+    finish (tree, quality == BvhQuality::high ? 3 : quality == BvhQuality::balanced ? 1 : 0, order, $nodes, $primitives, depth);
+}
+
+double i2t::Bvh::cost () const {
+    if ($nodes.empty ())
+        return 0.0;
+    auto root = area ({$nodes [0].lo, $nodes [0].hi});
+    if (root <= 0.0)
+        return COST_LEAF*$primitives.size ();
+    auto sum = 0.0;
+    for (const auto& node: $nodes) {
+        auto a = area ({node.lo, node.hi})/root;
+        sum += node.count ? COST_LEAF*a*node.count : COST_INNER*a;
+    }
+    return sum;
+}
+
+void i2t::Bvh::release_primitives () {
+    std::vector<std::uint32_t> ().swap ($primitives);
+}
+
+void i2t::Bvh::release_nodes () {
+    std::vector<Node> ().swap ($nodes);
+    std::vector<std::uint32_t> ().swap ($parents);
+    std::vector<double> ().swap ($cost);
+    std::vector<double> ().swap ($built);
+}
+
+/* Children come after their parent, so one backwards pass sees every
+   subtree before its root. */
+void i2t::Bvh::measure () {
+    auto n = $nodes.size ();
+    $parents.assign (n, 0u);
+    $cost.resize (n);
+    for (auto i = n; i-- > 0u;) {
+        const auto& node = $nodes [i];
+        auto a = area ({node.lo, node.hi});
+        if (node.count) {
+            $cost [i] = COST_LEAF*a*node.count;
+            continue;
+        }
+        $parents [i + 1u] = std::uint32_t (i);
+        $parents [node.offset] = std::uint32_t (i);
+        $cost [i] = COST_INNER*a + $cost [i + 1u] + $cost [node.offset];
+    }
+}
+
+bool i2t::Bvh::refit (const SceneData& scene, const std::vector<std::uint32_t>& moved, double rebuild) {
+    if ($nodes.empty () || moved.empty ())
+        return false;
+    if ($parents.size () != $nodes.size ()) {
+        measure ();
+        $built = $cost;
+    }
+    auto n = int ($nodes.size ());
+    std::vector<std::uint8_t> flagged (scene.triangle_count () + scene.spheres ().size (), 0u);
+    for (auto p: moved)
+        flagged [p] = 1u;
+
+    /* Touched nodes have a moved primitive below them, pending counts 
+       their touched children still to be refit. */
+    std::vector<std::uint8_t> touched (n, 0u);
+    std::unique_ptr<std::atomic<std::uint8_t> []> pending (new std::atomic<std::uint8_t> [n]);
+    #pragma omp parallel for
+    for (int i = 0; i < n; ++i) {
+        pending [i] = 0u;
+        const auto& node = $nodes [i];
+        for (auto k = 0u; k < node.count; ++k)
+            touched [i] |= flagged [$primitives [node.offset + k]];
+    }
+    std::vector<std::uint32_t> leaves;
+    for (auto i = 0; i < n; ++i)
+        if (touched [i])
+            leaves.push_back (std::uint32_t (i));
+    for (auto leaf: leaves) {
+        for (auto i = leaf; i != 0u;) {
+            i = $parents [i];
+            auto first = !touched [i];
+            touched [i] = 1u;
+            ++pending [i];
+            if (!first)
+                break;
+        }
+    }
+
+    /* The last child to finish refits its parent, as in bottom_up (). */
+    auto count = int (leaves.size ());
+    #pragma omp parallel for
+    for (int k = 0; k < count; ++k) {
+        auto i = leaves [k];
+        auto& leaf = $nodes [i];
+        Bounds box = {dvec3 (std::numeric_limits<double>::max ()), dvec3 (-std::numeric_limits<double>::max ())};
+        for (auto j = 0u; j < leaf.count; ++j)
+            box = join (box, primitive_bounds (scene, $primitives [leaf.offset + j]));
+        leaf.lo = box.lo;
+        leaf.hi = box.hi;
+        $cost [i] = COST_LEAF*area (box)*leaf.count;
+        while (i != 0u) {
+            i = $parents [i];
+            if (pending [i].fetch_sub (1u) != 1u)
+                break;
+            auto& node = $nodes [i];
+            const auto& l = $nodes [i + 1u];
+            const auto& r = $nodes [node.offset];
+            node.lo = min (l.lo, r.lo);
+            node.hi = max (l.hi, r.hi);
+            $cost [i] = COST_INNER*area ({node.lo, node.hi}) + $cost [i + 1u] + $cost [node.offset];
+        }
+    }
+
+    std::vector<std::uint32_t> roots, stack (1u, 0u);
+    while (!stack.empty ()) {
+        auto i = stack.back ();
+        stack.pop_back ();
+        const auto& node = $nodes [i];
+        if (node.count)
+            continue;
+        if ($cost [i] > rebuild*$built [i] && $cost [i] - $built [i] > REBUILD_SHARE*$built [0]) {
+            roots.push_back (i);
+            continue;
+        }
+        if (touched [i + 1u])
+            stack.push_back (i + 1u);
+        if (touched [node.offset])
+            stack.push_back (node.offset);
+    }
+    if (roots.empty ())
+        return false;
+
+    std::sort (roots.begin (), roots.end ());
+    splice (scene, roots);
+    return true;
+}
+
+/* Builds the subtrees at roots again over the primitives in their 
+   leaves, each on its own thread and within the depth left below their
+   root, and puts them in place of the old ones in a single pass. Everything else shifts by the growth of the subtrees
+   before it. Built costs are kept for the nodes that stay. */
+void i2t::Bvh::splice (const SceneData& scene, const std::vector<std::uint32_t>& roots) {
+    struct Subtree {
+        std::uint32_t root, nodes_end, begin, end;
+        Bvh bvh;
+    };
+    auto count = int (roots.size ());
+    std::vector<Subtree> subtrees (count);
+    #pragma omp parallel for schedule (dynamic)
+    for (int k = 0; k < count; ++k) {
+        auto& sub = subtrees [k];
+        auto first = roots [k], last = roots [k];
+        while (!$nodes [first].count)
+            ++first;
+        while (!$nodes [last].count)
+            last = $nodes [last].offset;
+        sub.root = roots [k];
+        sub.nodes_end = last + 1u;
+        sub.begin = $nodes [first].offset;
+        sub.end = $nodes [last].offset + $nodes [last].count;
+
+        std::vector<std::uint32_t> items ($primitives.begin () + sub.begin, $primitives.begin () + sub.end);
+        std::sort (items.begin (), items.end ());
+        items.erase (std::unique (items.begin (), items.end ()), items.end ());
+        std::vector<Bounds> bounds (items.size ());
+        for (auto i = 0u; i < items.size (); ++i)
+            bounds [i] = primitive_bounds (scene, items [i]);
+        auto depth = 0u;
+        for (auto i = sub.root; i != 0u; i = $parents [i])
+            ++depth;
+        if ($quality == BvhQuality::spatial)
+            sub.bvh.build_spatial (bounds, nullptr, 0.25, depth);
+        else
+            sub.bvh.build_linear (bounds, $quality, depth);
+        for (auto& p: sub.bvh.$primitives)
+            p = items [p];
+    }
+
+    /* Where an old node or primitive index lands once the subtrees 
+       ending at or before it have been replaced. */
+    std::vector<std::int64_t> node_shift (count + 1, 0), primitive_shift (count + 1, 0);
+    for (auto k = 0; k < count; ++k) {
+        const auto& sub = subtrees [k];
+        node_shift [k + 1] = node_shift [k] + std::int64_t (sub.bvh.$nodes.size ()) - (sub.nodes_end - sub.root);
+        primitive_shift [k + 1] = primitive_shift [k] + std::int64_t (sub.bvh.$primitives.size ()) - (sub.end - sub.begin);
+    }
+    auto moved_node = [&] (std::uint32_t i) {
+        auto k = std::upper_bound (subtrees.begin (), subtrees.end (), i, 
+            [] (std::uint32_t i, const Subtree& sub) { return i < sub.nodes_end; }) - subtrees.begin ();
+        return std::uint32_t (i + node_shift [k]);
+    };
+    auto moved_primitive = [&] (std::uint32_t i) {
+        auto k = std::upper_bound (subtrees.begin (), subtrees.end (), i, 
+            [] (std::uint32_t i, const Subtree& sub) { return i < sub.end; }) - subtrees.begin ();
+        return std::uint32_t (i + primitive_shift [k]);
+    };
+
+    std::vector<Node> nodes;
+    std::vector<std::uint32_t> primitives;
+    std::vector<double> built;
+    nodes.reserve (std::size_t ($nodes.size () + node_shift [count]));
+    primitives.reserve (std::size_t ($primitives.size () + primitive_shift [count]));
+    built.reserve (nodes.capacity ());
+    auto node = 0u, primitive = 0u;
+    auto keep = [&] (std::uint32_t nodes_end, std::uint32_t end) {
+        for (; node < nodes_end; ++node) {
+            auto n = $nodes [node];
+            n.offset = n.count ? moved_primitive (n.offset) : moved_node (n.offset);
+            nodes.push_back (n);
+            built.push_back ($built [node]);
+        }
+        primitives.insert (primitives.end (), $primitives.begin () + primitive, $primitives.begin () + end);
+        primitive = end;
+    };
+    for (auto& sub: subtrees) {
+        keep (sub.root, sub.begin);
+        auto root = std::uint32_t (nodes.size ()), begin = std::uint32_t (primitives.size ());
+        for (auto n: sub.bvh.$nodes) {
+            n.offset += n.count ? begin : root;
+            nodes.push_back (n);
+            built.push_back (-1.0);
+        }
+        primitives.insert (primitives.end (), sub.bvh.$primitives.begin (), sub.bvh.$primitives.end ());
+        node = sub.nodes_end;
+        primitive = sub.end;
+    }
+    keep (std::uint32_t ($nodes.size ()), std::uint32_t ($primitives.size ()));
+
+    $nodes.swap (nodes);
+    $primitives.swap (primitives);
+    measure ();
+    for (auto i = 0u; i < built.size (); ++i)
+        if (built [i] < 0.0)
+            built [i] = $cost [i];
+    $built.swap (built);
+}
+
+template <unsigned _Width>
+typename i2t::WideBvh<_Width>::Ray i2t::WideBvh<_Width>::ray (const dvec3& origin, const dvec3& direction) {
+    Ray r;
+    r.origin = origin;
+    for (auto i = 0; i < 3; ++i)
+        r.inverse [i] = 1.0/(direction [i] != 0.0 ? direction [i] : 1e-300);
+    return r;
+}
+
+template <unsigned _Width>
+void i2t::WideBvh<_Width>::build (const Bvh& bvh) {
+    $nodes.clear ();
+    if (bvh.empty ())
+        return;
+    collapse (bvh, 0u);
+}
+
+/* Rounding outwards keeps the boxes conservative. */
+template <unsigned _Width>
+void i2t::WideBvh<_Width>::store (Node& node, unsigned i, const Bounds& box) {
+    for (auto a = 0; a < 3; ++a) {
+        auto lo = float (box.lo [a]);
+        auto hi = float (box.hi [a]);
+        node.lo [a][i] = double (lo) > box.lo [a] ? std::nextafter (lo, -std::numeric_limits<float>::infinity ()) : lo;
+        node.hi [a][i] = double (hi) < box.hi [a] ? std::nextafter (hi, std::numeric_limits<float>::infinity ()) : hi;
+    }
+}
+
+/* Children come after their parent here too, so a backwards pass can 
+   take an inner child's box from the boxes stored in it. */
+template <unsigned _Width>
+void i2t::WideBvh<_Width>::refit (const Bvh& bvh, const SceneData& scene, const std::vector<std::uint32_t>& moved) {
+    std::vector<std::uint8_t> flagged (scene.triangle_count () + scene.spheres ().size (), 0u);
+    for (auto p: moved)
+        flagged [p] = 1u;
+    std::vector<std::uint8_t> changed ($nodes.size (), 0u);
+    const auto& primitives = bvh.primitives ();
+    for (auto i = $nodes.size (); i-- > 0u;) {
+        auto& node = $nodes [i];
+        for (auto k = 0u; k < node.children; ++k) {
+            Bounds box = {dvec3 (std::numeric_limits<double>::max ()), dvec3 (-std::numeric_limits<double>::max ())};
+            if (node.count [k]) {
+                auto any = false;
+                for (auto j = 0u; j < node.count [k]; ++j)
+                    any |= flagged [primitives [node.child [k] + j]] != 0u;
+                if (!any)
+                    continue;
+                for (auto j = 0u; j < node.count [k]; ++j)
+                    box = join (box, Bvh::primitive_bounds (scene, primitives [node.child [k] + j]));
+            }
+            else {
+                if (!changed [node.child [k]])
+                    continue;
+                const auto& child = $nodes [node.child [k]];
+                for (auto m = 0u; m < child.children; ++m)
+                    for (auto a = 0; a < 3; ++a) {
+                        box.lo [a] = std::min (box.lo [a], double (child.lo [a][m]));
+                        box.hi [a] = std::max (box.hi [a], double (child.hi [a][m]));
+                    }
+            }
+            store (node, k, box);
+            changed [i] = 1u;
+        }
+    }
+}
+
+template <unsigned _Width>
+std::uint32_t i2t::WideBvh<_Width>::collapse (const Bvh& bvh, std::uint32_t index) {
+    const auto& nodes = bvh.nodes ();
+    std::uint32_t children [_Width];
+    auto count = 0u;
+    if (nodes [index].count)
+        children [count++] = index;
+    else {
+        children [count++] = index + 1u;
+        children [count++] = nodes [index].offset;
+    }
+    while (count < _Width) {
+        auto pick = count;
+        auto largest = -1.0;
+        for (auto i = 0u; i < count; ++i) {
+            const auto& n = nodes [children [i]];
+            if (n.count)
+                continue;
+            auto a = area ({n.lo, n.hi});
+            if (a > largest) {
+                largest = a;
+                pick = i;
+            }
+        }
+        if (pick == count)
+            break;
+        auto opened = children [pick];
+        children [pick] = opened + 1u;
+        children [count++] = nodes [opened].offset;
+    }
+
+    auto slot = std::uint32_t ($nodes.size ());
+    $nodes.emplace_back ();
+    $nodes [slot].children = count;
+    for (auto i = 0u; i < _Width; ++i) {
+        auto& wide = $nodes [slot];
+        if (i >= count) {
+            for (auto a = 0; a < 3; ++a)
+                wide.lo [a][i] = wide.hi [a][i] = 0.0f;
+            wide.child [i] = wide.count [i] = 0u;
+            continue;
+        }
+        const auto& n = nodes [children [i]];
+        store (wide, i, {n.lo, n.hi});
+        wide.child [i] = n.offset;
+        wide.count [i] = n.count;
+    }
+    for (auto i = 0u; i < count; ++i) {
+        if (!nodes [children [i]].count) {
+            auto child = collapse (bvh, children [i]);
+            $nodes [slot].child [i] = child;
+        }
+    }
+    return slot;
+}
+
+/* Same slab test as the binary traversal, tnear starts at zero. */
+template <unsigned _Width>
+unsigned i2t::WideBvh<_Width>::enter (const Node& node, const Ray& ray, double tmax, double* tnear) {
+    auto mask = 0u;
+#if defined (I2T_AVX)
+    for (auto k = 0u; k < _Width; k += 4u) {
+        auto t_in = _mm256_setzero_pd ();
+        auto t_out = _mm256_set1_pd (tmax);
+        for (auto a = 0; a < 3; ++a) {
+            auto o = _mm256_set1_pd (ray.origin [a]);
+            auto inv = _mm256_set1_pd (ray.inverse [a]);
+            auto t0 = _mm256_mul_pd (_mm256_sub_pd (_mm256_cvtps_pd (_mm_loadu_ps (&node.lo [a][k])), o), inv);
+            auto t1 = _mm256_mul_pd (_mm256_sub_pd (_mm256_cvtps_pd (_mm_loadu_ps (&node.hi [a][k])), o), inv);
+            t_in = _mm256_max_pd (t_in, _mm256_min_pd (t0, t1));
+            t_out = _mm256_min_pd (t_out, _mm256_max_pd (t0, t1));
+        }
+        _mm256_storeu_pd (tnear + k, t_in);
+        mask |= unsigned (_mm256_movemask_pd (_mm256_cmp_pd (t_in, t_out, _CMP_LE_OQ))) << k;
+    }
+#elif defined (I2T_SSE2)
+    for (auto k = 0u; k < _Width; k += 4u) {
+        auto t_in0 = _mm_setzero_pd (), t_in1 = t_in0;
+        auto t_out0 = _mm_set1_pd (tmax), t_out1 = t_out0;
+        for (auto a = 0; a < 3; ++a) {
+            auto o = _mm_set1_pd (ray.origin [a]);
+            auto inv = _mm_set1_pd (ray.inverse [a]);
+            auto lo = _mm_loadu_ps (&node.lo [a][k]);
+            auto hi = _mm_loadu_ps (&node.hi [a][k]);
+            auto lo0 = _mm_mul_pd (_mm_sub_pd (_mm_cvtps_pd (lo), o), inv);
+            auto hi0 = _mm_mul_pd (_mm_sub_pd (_mm_cvtps_pd (hi), o), inv);
+            auto lo1 = _mm_mul_pd (_mm_sub_pd (_mm_cvtps_pd (_mm_movehl_ps (lo, lo)), o), inv);
+            auto hi1 = _mm_mul_pd (_mm_sub_pd (_mm_cvtps_pd (_mm_movehl_ps (hi, hi)), o), inv);
+            t_in0 = _mm_max_pd (t_in0, _mm_min_pd (lo0, hi0));
+            t_out0 = _mm_min_pd (t_out0, _mm_max_pd (lo0, hi0));
+            t_in1 = _mm_max_pd (t_in1, _mm_min_pd (lo1, hi1));
+            t_out1 = _mm_min_pd (t_out1, _mm_max_pd (lo1, hi1));
+        }
+        _mm_storeu_pd (tnear + k, t_in0);
+        _mm_storeu_pd (tnear + k + 2u, t_in1);
+        mask |= unsigned (_mm_movemask_pd (_mm_cmple_pd (t_in0, t_out0))) << k;
+        mask |= unsigned (_mm_movemask_pd (_mm_cmple_pd (t_in1, t_out1))) << (k + 2u);
+    }
+#else
+    for (auto i = 0u; i < _Width; ++i) {
+        auto t_in = 0.0, t_out = tmax;
+        for (auto a = 0; a < 3; ++a) {
+            auto t0 = (node.lo [a][i] - ray.origin [a])*ray.inverse [a];
+            auto t1 = (node.hi [a][i] - ray.origin [a])*ray.inverse [a];
+            t_in = std::max (t_in, std::min (t0, t1));
+            t_out = std::min (t_out, std::max (t0, t1));
+        }
+        tnear [i] = t_in;
+        mask |= unsigned (t_in <= t_out) << i;
+    }
+#endif
+    return mask & ((1u << node.children) - 1u);
+}
+
+template <unsigned _Width>
+i2t::Bounds i2t::WideBvh<_Width>::bounds (const Node& node, unsigned i) {
+    Bounds b;
+    for (auto a = 0; a < 3; ++a) {
+        b.lo [a] = node.lo [a][i];
+        b.hi [a] = node.hi [a][i];
+    }
+    return b;
+}
+
+template <unsigned _Width>
+void i2t::QuantizedBvh<_Width>::build (const WideBvh<_Width>& wide) {
+    $nodes.clear ();
+    $nodes.resize (wide.nodes ().size ());
+    for (auto i = 0u; i < $nodes.size (); ++i) {
+        const auto& w = wide.nodes () [i];
+        auto& q = $nodes [i];
+        q.children = std::uint8_t (w.children);
+        for (auto a = 0; a < 3; ++a) {
+            auto lo = std::numeric_limits<float>::max ();
+            auto hi = -lo;
+            for (auto c = 0u; c < w.children; ++c) {
+                lo = std::min (lo, w.lo [a][c]);
+                hi = std::max (hi, w.hi [a][c]);
+            }
+            auto exponent = 0;
+            std::frexp ((double (hi) - lo)/255.0, &exponent);
+            exponent = std::max (exponent, -126);
+            while (double (hi) - lo > std::ldexp (255.0, exponent))
+                ++exponent;
+            auto scale = std::ldexp (1.0, exponent);
+            q.origin [a] = lo;
+            q.exponent [a] = std::int8_t (std::max (-128, std::min (127, exponent)));
+            for (auto c = 0u; c < _Width; ++c) {
+                if (c >= w.children) {
+                    q.lo [a][c] = q.hi [a][c] = 0u;
+                    continue;
+                }
+                auto l = std::floor ((double (w.lo [a][c]) - lo)/scale);
+                auto h = std::ceil ((double (w.hi [a][c]) - lo)/scale);
+                q.lo [a][c] = std::uint8_t (std::max (0.0, std::min (255.0, l)));
+                q.hi [a][c] = std::uint8_t (std::max (0.0, std::min (255.0, h)));
+            }
+        }
+        for (auto c = 0u; c < _Width; ++c) {
+            q.child [c] = w.child [c];
+            q.count [c] = std::uint8_t (w.count [c]);
+        }
+    }
+}
+
+/* Boxes are decoded to double in full before the slab test, rather than 
+   folding the scale into the ray, so the test rounds exactly like the 
+   uncompressed one. */
+template <unsigned _Width>
+unsigned i2t::QuantizedBvh<_Width>::enter (const Node& node, const Ray& ray, double tmax, double* tnear) {
+    auto mask = 0u;
+#if defined (I2T_AVX)
+    for (auto k = 0u; k < _Width; k += 4u) {
+        auto t_in = _mm256_setzero_pd ();
+        auto t_out = _mm256_set1_pd (tmax);
+        auto zero = _mm_setzero_si128 ();
+        for (auto a = 0; a < 3; ++a) {
+            auto o = _mm256_set1_pd (ray.origin [a]);
+            auto inv = _mm256_set1_pd (ray.inverse [a]);
+            auto base = _mm256_set1_pd (node.origin [a]);
+            auto scale = _mm256_set1_pd (power_of_two (node.exponent [a]));
+            std::int32_t lo, hi;
+            std::memcpy (&lo, &node.lo [a][k], 4u);
+            std::memcpy (&hi, &node.hi [a][k], 4u);
+            auto qlo = _mm_unpacklo_epi16 (_mm_unpacklo_epi8 (_mm_cvtsi32_si128 (lo), zero), zero);
+            auto qhi = _mm_unpacklo_epi16 (_mm_unpacklo_epi8 (_mm_cvtsi32_si128 (hi), zero), zero);
+            auto blo = _mm256_add_pd (base, _mm256_mul_pd (_mm256_cvtepi32_pd (qlo), scale));
+            auto bhi = _mm256_add_pd (base, _mm256_mul_pd (_mm256_cvtepi32_pd (qhi), scale));
+            auto t0 = _mm256_mul_pd (_mm256_sub_pd (blo, o), inv);
+            auto t1 = _mm256_mul_pd (_mm256_sub_pd (bhi, o), inv);
+            t_in = _mm256_max_pd (t_in, _mm256_min_pd (t0, t1));
+            t_out = _mm256_min_pd (t_out, _mm256_max_pd (t0, t1));
+        }
+        _mm256_storeu_pd (tnear + k, t_in);
+        mask |= unsigned (_mm256_movemask_pd (_mm256_cmp_pd (t_in, t_out, _CMP_LE_OQ))) << k;
+    }
+#elif defined (I2T_SSE2)
+    for (auto k = 0u; k < _Width; k += 4u) {
+        auto t_in0 = _mm_setzero_pd (), t_in1 = t_in0;
+        auto t_out0 = _mm_set1_pd (tmax), t_out1 = t_out0;
+        auto zero = _mm_setzero_si128 ();
+        for (auto a = 0; a < 3; ++a) {
+            auto o = _mm_set1_pd (ray.origin [a]);
+            auto inv = _mm_set1_pd (ray.inverse [a]);
+            auto base = _mm_set1_pd (node.origin [a]);
+            auto scale = _mm_set1_pd (power_of_two (node.exponent [a]));
+            std::int32_t lo, hi;
+            std::memcpy (&lo, &node.lo [a][k], 4u);
+            std::memcpy (&hi, &node.hi [a][k], 4u);
+            auto qlo = _mm_unpacklo_epi16 (_mm_unpacklo_epi8 (_mm_cvtsi32_si128 (lo), zero), zero);
+            auto qhi = _mm_unpacklo_epi16 (_mm_unpacklo_epi8 (_mm_cvtsi32_si128 (hi), zero), zero);
+            auto decode = [&] (__m128i q) { return _mm_sub_pd (_mm_add_pd (base, _mm_mul_pd (_mm_cvtepi32_pd (q), scale)), o); };
+            auto lo0 = _mm_mul_pd (decode (qlo), inv);
+            auto hi0 = _mm_mul_pd (decode (qhi), inv);
+            auto lo1 = _mm_mul_pd (decode (_mm_srli_si128 (qlo, 8)), inv);
+            auto hi1 = _mm_mul_pd (decode (_mm_srli_si128 (qhi, 8)), inv);
+            t_in0 = _mm_max_pd (t_in0, _mm_min_pd (lo0, hi0));
+            t_out0 = _mm_min_pd (t_out0, _mm_max_pd (lo0, hi0));
+            t_in1 = _mm_max_pd (t_in1, _mm_min_pd (lo1, hi1));
+            t_out1 = _mm_min_pd (t_out1, _mm_max_pd (lo1, hi1));
+        }
+        _mm_storeu_pd (tnear + k, t_in0);
+        _mm_storeu_pd (tnear + k + 2u, t_in1);
+        mask |= unsigned (_mm_movemask_pd (_mm_cmple_pd (t_in0, t_out0))) << k;
+        mask |= unsigned (_mm_movemask_pd (_mm_cmple_pd (t_in1, t_out1))) << (k + 2u);
+    }
+#else
+    for (auto i = 0u; i < _Width; ++i) {
+        auto t_in = 0.0, t_out = tmax;
+        for (auto a = 0; a < 3; ++a) {
+            auto scale = power_of_two (node.exponent [a]);
+            auto t0 = (node.origin [a] + node.lo [a][i]*scale - ray.origin [a])*ray.inverse [a];
+            auto t1 = (node.origin [a] + node.hi [a][i]*scale - ray.origin [a])*ray.inverse [a];
+            t_in = std::max (t_in, std::min (t0, t1));
+            t_out = std::min (t_out, std::max (t0, t1));
+        }
+        tnear [i] = t_in;
+        mask |= unsigned (t_in <= t_out) << i;
+    }
+#endif
+    return mask & ((1u << node.children) - 1u);
+}
+
+template <unsigned _Width>
+i2t::Bounds i2t::QuantizedBvh<_Width>::bounds (const Node& node, unsigned i) {
+    Bounds b;
+    for (auto a = 0; a < 3; ++a) {
+        auto scale = power_of_two (node.exponent [a]);
+        b.lo [a] = node.origin [a] + node.lo [a][i]*scale;
+        b.hi [a] = node.origin [a] + node.hi [a][i]*scale;
+    }
+    return b;
+}
+
+template struct i2t::WideBvh<4u>;
+template struct i2t::WideBvh<8u>;
+template struct i2t::QuantizedBvh<4u>;
+template struct i2t::QuantizedBvh<8u>;
@@ -0,0 +1,192 @@
+#ifndef __BVH_H__
+#define __BVH_H__
+
+#include "Parser.h"
+#include "Common.h"
+#include <vector>
+
+namespace i2t {
+
+    struct BvhCache;
+
+    /* How much build time to spend for faster tracing. fast is a plain
+       linear BVH: primitives sorted along a Morton curve and split where
+       the codes first differ, about half a second per million primitives 
+       on one core. balanced adds a pass of treelet restructuring, which 
+       takes the SAH cost down 5-7% for four times the build time. high 
+       runs three passes for another percent or two at twelve times, and 
+       is only worth it for scenes traced long enough to pay for it. 
+       spatial is a serial top down SAH build that may also cut primitives
+       at a split plane and reference them from both sides, then refined as
+       high is. It pays off on long thin triangles whose boxes would 
+       otherwise overlap, at several times the build time of high. */
+    enum class BvhQuality {
+        fast,
+        balanced,
+        high,
+        spatial
+    };
+
+    struct Bounds {
+        dvec3 lo;
+        dvec3 hi;
+    };
+
+    /* Bounding volume hierarchy over primitive bounds, laid out depth
+       first: an inner node's first child follows it, offset is the second.
+       Leaves have a count and refer to a run of primitives () starting at
+       offset, where a primitive may appear more than once after spatial
+       splits. The linear builds are parallel throughout bar the final 
+       layout pass. */
+    struct Bvh {
+        struct Node {
+            dvec3 lo;
+            dvec3 hi;
+            std::uint32_t offset;
+            std::uint32_t count;
+        };
+
+        static const std::uint32_t MAX_LEAF = 4u;
+
+        /* No leaf lies deeper than this below the root, so a traversal
+           stack of this many entries per level never overflows. */
+        static const unsigned MAX_DEPTH = 64u;
+
+        /* Triangles first, then spheres, same as primitive numbering. The
+           first reads released triangles back from the scene's spill. */
+        static std::vector<Bounds> primitive_bounds (const SceneData& scene);
+        static Bounds primitive_bounds (const SceneData& scene, std::uint32_t primitive);
+
+        /* With spatial splits, duplication caps the extra references as a
+           fraction of the primitive count. Without the scene only boxes 
+           can be cut, so the overload taking bounds clips those. */
+        void build (const SceneData& scene, BvhQuality quality, double duplication = 0.25);
+        void build (const std::vector<Bounds>& bounds, BvhQuality quality);
+
+        bool empty () const { return $nodes.empty (); }
+        const std::vector<Node>& nodes () const { return $nodes; }
+        const std::vector<std::uint32_t>& primitives () const { return $primitives; }
+
+        /* Frees the nodes once a collapsed copy is made, primitives () stay. */
+        void release_nodes ();
+
+        /* Frees primitives () once a GeometryStore holds them. */
+        void release_primitives ();
+
+        /* Brings the boxes of the leaves holding moved primitives, and of
+           their ancestors, up to date with the scene, from the leaves up 
+           in parallel. The topmost subtrees whose SAH cost has since grown
+           past rebuild times what it was when built are then built again 
+           in place. Returns whether any was, which changes the layout of 
+           nodes () and primitives (). Needs the nodes. */
+        bool refit (const SceneData& scene, const std::vector<std::uint32_t>& moved, double rebuild);
+
+        /* Surface area heuristic cost relative to a single leaf. */
+        double cost () const;
+
+    private:
+        friend struct BvhCache;
+
+        void build_linear (const std::vector<Bounds>& bounds, BvhQuality quality, unsigned depth);
+        void build_spatial (const std::vector<Bounds>& bounds, const SceneData* scene, double duplication, unsigned depth);
+        void measure ();
+        void splice (const SceneData& scene, const std::vector<std::uint32_t>& roots);
+
+        std::vector<Node>           $nodes;
+        std::vector<std::uint32_t>  $primitives;
+        BvhQuality                  $quality = BvhQuality::fast;
+
+        /* Kept for refit () once it's first called: each node's parent, 
+           and its subtree's SAH cost now and when built. */
+        std::vector<std::uint32_t>  $parents;
+        std::vector<double>         $cost;
+        std::vector<double>         $built;
+    };
+
+    /* The binary hierarchy collapsed so each node holds up to _Width 
+       children, found by opening the largest child until the node is 
+       full. Child boxes are kept per axis in arrays of floats rounded
+       outwards, so one SIMD sequence tests them all: SSE2 two at a time,
+       AVX four. The test itself is done in double, so it never misses a 
+       box the binary one would enter. Leaves are children with a count, 
+       pointing into the binary hierarchy's primitives (). */
+    template <unsigned _Width>
+    struct WideBvh {
+        struct Node {
+            float lo [3][_Width];
+            float hi [3][_Width];
+            std::uint32_t child [_Width];
+            std::uint32_t count [_Width];
+            std::uint32_t children;
+        };
+
+        /* Ray set up for enter (), zero directions made tiny so no slab 
+           ever divides zero by zero. */
+        struct Ray {
+            dvec3 origin;
+            dvec3 inverse;
+        };
+
+        static Ray ray (const dvec3& origin, const dvec3& direction);
+
+        void build (const Bvh& bvh);
+
+        /* Refits the boxes over moved primitives in place, for when the
+           binary hierarchy was refit without changing its layout. */
+        void refit (const Bvh& bvh, const SceneData& scene, const std::vector<std::uint32_t>& moved);
+
+        bool empty () const { return $nodes.empty (); }
+        const std::vector<Node>& nodes () const { return $nodes; }
+
+        /* Bit i is set when the ray enters child i before tmax, at tnear [i]. */
+        static unsigned enter (const Node& node, const Ray& ray, double tmax, double* tnear);
+        static Bounds bounds (const Node& node, unsigned i);
+
+    private:
+        friend struct BvhCache;
+
+        static void store (Node& node, unsigned i, const Bounds& box);
+        std::uint32_t collapse (const Bvh& bvh, std::uint32_t node);
+
+        std::vector<Node> $nodes;
+    };
+
+    /* WideBvh with child boxes stored as 8 bit offsets on a grid over the
+       node's own box, spaced by a power of two per axis. Decoding is then
+       exact in double, and rounding down and up when encoding keeps the
+       boxes conservative. Nodes come to 60 bytes at width 4 and 104 at 8,
+       against 132 and 260 uncompressed. */
+    template <unsigned _Width>
+    struct QuantizedBvh {
+        struct Node {
+            float origin [3];
+            std::int8_t exponent [3];
+            std::uint8_t children;
+            std::uint8_t lo [3][_Width];
+            std::uint8_t hi [3][_Width];
+            std::uint32_t child [_Width];
+            std::uint8_t count [_Width];
+        };
+
+        typedef typename WideBvh<_Width>::Ray Ray;
+
+        void build (const WideBvh<_Width>& wide);
+
+        bool empty () const { return $nodes.empty (); }
+        const std::vector<Node>& nodes () const { return $nodes; }
+
+        static Ray ray (const dvec3& origin, const dvec3& direction) { 
+            return WideBvh<_Width>::ray (origin, direction); 
+        }
+        static unsigned enter (const Node& node, const Ray& ray, double tmax, double* tnear);
+        static Bounds bounds (const Node& node, unsigned i);
+
+    private:
+        friend struct BvhCache;
+
+        std::vector<Node> $nodes;
+    };
+
+}
+
+#endif
@@ -0,0 +1,184 @@
+#include "BvhCache.h"
+#include <cstdio>
+#include <fstream>
+#include <algorithm>
+#include <random>
+
+namespace {
+    using namespace i2t;
+
+    static const std::uint32_t MAGIC = 0x56423249u;
+    static const std::uint32_t VERSION = 2u;
+    static const std::uint64_t ALIGNMENT = 64u;
+
+    enum {
+        NODES,
+        PRIMITIVES,
+        WIDE4,
+        WIDE8,
+        QUANTIZED4,
+        QUANTIZED8,
+        SECTIONS
+    };
+
+    struct Section {
+        std::uint64_t offset;
+        std::uint64_t count;
+    };
+
+    struct Header {
+        std::uint32_t magic;
+        std::uint32_t version;
+        std::uint64_t key;
+        std::uint32_t quality;
+        std::uint32_t padding;
+        Section sections [SECTIONS];
+    };
+
+    /* A section has to lie within the file, so a corrupt header can't 
+       have it allocate more than the file holds. */
+    template <typename _Item>
+    static bool read_section (std::ifstream& in, std::uint64_t size, const Section& section, std::vector<_Item>& items) {
+        if (section.offset > size || section.count > (size - section.offset)/sizeof (_Item))
+            return false;
+        items.resize (std::size_t (section.count));
+        if (!section.count)
+            return true;
+        in.seekg (std::streamoff (section.offset));
+        return bool (in.read (reinterpret_cast<char*> (items.data ()), items.size ()*sizeof (_Item)));
+    }
+
+    template <typename _Item>
+    static void write_section (std::ofstream& out, Section& section, const std::vector<_Item>& items) {
+        auto at = std::uint64_t (out.tellp ());
+        auto aligned = (at + ALIGNMENT - 1u)/ALIGNMENT*ALIGNMENT;
+        static const char zeros [ALIGNMENT] = {};
+        out.write (zeros, std::streamsize (aligned - at));
+        section.offset = aligned;
+        section.count = items.size ();
+        out.write (reinterpret_cast<const char*> (items.data ()), items.size ()*sizeof (_Item));
+    }
+
+}
+
+/* The geometry is hashed in chunks on all threads, then the chunk hashes
+   in order, which keeps the key the same for any thread count. Released
+   triangles go in by the hash the scene kept of them. Node sizes go in
+   too, so a build with a different layout never reads the file. */
+std::uint64_t i2t::BvhCache::key (const SceneData& scene, BvhQuality quality,
+    double duplication, unsigned width, bool compressed)
+{
+    static const int CHUNK = 4096;
+    const auto& triangles = scene.triangles ();
+    const auto& spheres = scene.spheres ();
+    auto tchunks = int ((triangles.size () + CHUNK - 1)/CHUNK);
+    auto schunks = int ((spheres.size () + CHUNK - 1)/CHUNK);
+    std::vector<std::uint64_t> chunks (tchunks + schunks);
+    #pragma omp parallel for
+    for (int c = 0; c < tchunks + schunks; ++c) {
+        auto h = 14695981039346656037ull;
+        if (c < tchunks) {
+            auto end = std::min (triangles.size (), std::size_t (c + 1)*CHUNK);
+            for (auto i = std::size_t (c)*CHUNK; i < end; ++i) {
+                h = hash_value (triangles [i].v0, h);
+                h = hash_value (triangles [i].v1, h);
+                h = hash_value (triangles [i].v2, h);
+            }
+        }
+        else {
+            auto end = std::min (spheres.size (), std::size_t (c - tchunks + 1)*CHUNK);
+            for (auto i = std::size_t (c - tchunks)*CHUNK; i < end; ++i)
+                h = hash_value (spheres [i].T, h);
+        }
+        chunks [c] = h;
+    }
+
+    auto h = hash_value (VERSION, 14695981039346656037ull);
+    h = hash_value (scene.triangle_count (), h);
+    h = hash_value (scene.released_hash (), h);
+    h = hash_value (spheres.size (), h);
+    h = hash_bytes (chunks.data (), chunks.size ()*sizeof (std::uint64_t), h);
+    h = hash_value (quality, h);
+    if (quality == BvhQuality::spatial)
+        h = hash_value (duplication, h);
+    h = hash_value (width, h);
+    h = hash_value (compressed, h);
+    h = hash_value (sizeof (Bvh::Node), h);
+    h = hash_value (sizeof (WideBvh<4u>::Node), h);
+    h = hash_value (sizeof (WideBvh<8u>::Node), h);
+    h = hash_value (sizeof (QuantizedBvh<4u>::Node), h);
+    return hash_value (sizeof (QuantizedBvh<8u>::Node), h);
+}
+
+std::string i2t::BvhCache::path (const std::string& directory, std::uint64_t key) {
+    char name [24];
+    std::snprintf (name, sizeof (name), "%016llx.bvh", static_cast<unsigned long long> (key));
+    if (directory.empty () || directory.back () == '/' || directory.back () == '\\')
+        return directory + name;
+    return directory + "/" + name;
+}
+
+bool i2t::BvhCache::load (const std::string& path, std::uint64_t key, Bvh& bvh,
+    WideBvh<4u>& bvh4, WideBvh<8u>& bvh8, QuantizedBvh<4u>& qbvh4, QuantizedBvh<8u>& qbvh8)
+{
+    std::ifstream in (path, std::ios::binary | std::ios::ate);
+    auto size = std::uint64_t (std::max<std::streamoff> (in.tellg (), 0));
+    in.seekg (0);
+    Header h;
+    if (!in.read (reinterpret_cast<char*> (&h), sizeof (h)))
+        return false;
+    if (h.magic != MAGIC || h.version != VERSION || h.key != key)
+        return false;
+    auto ok = read_section (in, size, h.sections [NODES], bvh.$nodes)
+        && read_section (in, size, h.sections [PRIMITIVES], bvh.$primitives)
+        && read_section (in, size, h.sections [WIDE4], bvh4.$nodes)
+        && read_section (in, size, h.sections [WIDE8], bvh8.$nodes)
+        && read_section (in, size, h.sections [QUANTIZED4], qbvh4.$nodes)
+        && read_section (in, size, h.sections [QUANTIZED8], qbvh8.$nodes);
+    bvh.$quality = BvhQuality (h.quality);
+    bvh.$parents.clear ();
+    if (ok)
+        return true;
+    bvh = Bvh ();
+    bvh4 = WideBvh<4u> ();
+    bvh8 = WideBvh<8u> ();
+    qbvh4 = QuantizedBvh<4u> ();
+    qbvh8 = QuantizedBvh<8u> ();
+    return false;
+}
+
+/* Written next to the target and renamed over it, as checkpoints are, so
+   a run reading the cache never sees half a file. The temporary name is
+   drawn at random, as workers sharing a cache may save at once. */
+bool i2t::BvhCache::save (const std::string& path, std::uint64_t key, const Bvh& bvh,
+    const WideBvh<4u>& bvh4, const WideBvh<8u>& bvh8, const QuantizedBvh<4u>& qbvh4, const QuantizedBvh<8u>& qbvh8)
+{
+    auto temp = path + "." + std::to_string (std::random_device () ()) + ".tmp";
+    auto written = false;
+    {
+        std::ofstream out (temp, std::ios::binary | std::ios::trunc);
+        Header h = {};
+        h.magic = MAGIC;
+        h.version = VERSION;
+        h.key = key;
+        h.quality = std::uint32_t (bvh.$quality);
+        out.write (reinterpret_cast<const char*> (&h), sizeof (h));
+        write_section (out, h.sections [NODES], bvh.$nodes);
+        write_section (out, h.sections [PRIMITIVES], bvh.$primitives);
+        write_section (out, h.sections [WIDE4], bvh4.$nodes);
+        write_section (out, h.sections [WIDE8], bvh8.$nodes);
+        write_section (out, h.sections [QUANTIZED4], qbvh4.$nodes);
+        write_section (out, h.sections [QUANTIZED8], qbvh8.$nodes);
+        out.seekp (0);
+        out.write (reinterpret_cast<const char*> (&h), sizeof (h));
+        written = bool (out.flush ());
+    }
+    if (!written) {
+        std::remove (temp.c_str ());
+        return false;
+    }
+    if (std::rename (temp.c_str (), path.c_str ()) == 0)
+        return true;
+    std::remove (path.c_str ());
+    return std::rename (temp.c_str (), path.c_str ()) == 0;
+}
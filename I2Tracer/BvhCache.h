@@ -0,0 +1,30 @@
+#ifndef __BVH_CACHE_H__
+#define __BVH_CACHE_H__
+
+#include "Bvh.h"
+#include <string>
+
+namespace i2t {
+
+    /* Built hierarchies kept on disk, so runs over unchanged geometry skip
+       the build whatever the camera, lights or materials. A file is a
+       header and the raw node and primitive arrays at 64 byte aligned
+       offsets. Nodes only hold indices, so the arrays read back as they
+       are with nothing to fix up, and the file could as well be mapped.
+       The key covers the geometry and every build setting, and names the
+       file in the cache directory. */
+    struct BvhCache {
+        static std::uint64_t key (const SceneData& scene, BvhQuality quality,
+            double duplication, unsigned width, bool compressed);
+        static std::string path (const std::string& directory, std::uint64_t key);
+
+        /* Hierarchies not built for these settings are empty and stay so. */
+        static bool load (const std::string& path, std::uint64_t key, Bvh& bvh,
+            WideBvh<4u>& bvh4, WideBvh<8u>& bvh8, QuantizedBvh<4u>& qbvh4, QuantizedBvh<8u>& qbvh8);
+        static bool save (const std::string& path, std::uint64_t key, const Bvh& bvh,
+            const WideBvh<4u>& bvh4, const WideBvh<8u>& bvh8, const QuantizedBvh<4u>& qbvh4, const QuantizedBvh<8u>& qbvh8);
+    };
+
+}
+
+#endif
@@ -0,0 +1,192 @@
+#include "Camera.h"
+#include <cmath>
+#include <algorithm>
+
+#if defined (_M_X64) || defined (__SSE2__)
+#   include <emmintrin.h>
+#   define I2T_SSE2
+#endif
+
+void i2t::RayBatch::resize (std::size_t count) {
+    x.resize (count);
+    y.resize (count);
+    dx.resize (count);
+    dy.resize (count);
+    dz.resize (count);
+}
+
+namespace {
+
+    static unsigned gcd (unsigned a, unsigned b) {
+        while (b) {
+            auto r = a % b;
+            a = b;
+            b = r;
+        }
+        return a;
+    }
+
+}
+
+i2t::Camera::Camera (const SceneData::Camera& camera, unsigned samples, Jitter jitter):
+    $size (camera.size),
+    $samples (jitter == Jitter::none ? 1u : std::max (samples, 1u)),
+    $jitter (jitter)
+{
+    auto width  = int (camera.size.x);
+    auto height = int (camera.size.y);
+    auto fov    = 0.5*radians (camera.fov); 
+    auto aspect = (1.0*width)/height;
+
+    $halfw  = 0.5*width;
+    $halfh  = 0.5*height;
+    $tanfx  = (std::tan (fov)/$halfw)*aspect;
+    $tanfy  = (std::tan (fov)/$halfh);
+    $eye    = camera.eye;
+    $w      = normalize (dvec3 (camera.eye - camera.center));
+    $u      = normalize (cross (dvec3 (camera.up), $w));
+    $v      = normalize (cross ($w, $u));
+    $grid   = unsigned (std::ceil (std::sqrt (double ($samples))));
+    if ($jitter == Jitter::grid)
+        $samples = $grid*$grid;
+
+    /* A shear coprime to the count steps through every row once. About
+       the square root spreads rows as far apart as a sheared grid can. */
+    $shear  = std::max (1u, unsigned (std::floor (std::sqrt (double ($samples)) + 0.5)));
+    while (gcd ($shear, $samples) != 1u)
+        ++$shear;
+}
+
+i2t::dvec2 i2t::Camera::offset (int x, int y, unsigned s, unsigned pass) const {
+    auto n = double ($samples);
+    switch ($jitter) {
+    case Jitter::grid:
+        return (dvec2 (s % $grid, s / $grid) + 0.5)/double ($grid);
+    case Jitter::rotated: {
+        auto row = $grid*$grid == $samples ? (s % $grid)*$grid + s/$grid : (s*$shear) % $samples;
+        return dvec2 (s + 0.5, row + 0.5)/n;
+    }
+    case Jitter::random: {
+        Random rng (hash_value (s, hash_value (pass, std::uint64_t (x) + std::uint64_t (y)*$size.x)));
+        auto u = rng ();
+        return dvec2 (u, rng ());
+    }
+    default:
+        return dvec2 (0.5);
+    }
+}
+
+/* Pixel positions go into the direction arrays first and are turned into
+   normalized directions in place, two lanes at a time. */
+void i2t::Camera::generate (int x0, int y0, int x1, int y1, unsigned pass, RayBatch& out) const {
+    out.resize (std::size_t (std::max (x1 - x0, 0))*std::max (y1 - y0, 0)*$samples);
+    auto k = std::size_t (0u);
+    if ($jitter == Jitter::none) {
+        for (auto y = y0; y < y1; ++y)
+        for (auto x = x0; x < x1; ++x, ++k) {
+            out.x [k] = x;
+            out.y [k] = y;
+            out.dx [k] = x + 0.5;
+            out.dy [k] = y + 0.5;
+        }
+    }
+    else for (auto y = y0; y < y1; ++y)
+    for (auto x = x0; x < x1; ++x)
+    for (auto s = 0u; s < $samples; ++s, ++k) {
+        auto o = offset (x, y, s, pass);
+        out.x [k] = x;
+        out.y [k] = y;
+        out.dx [k] = x + o.x;
+        out.dy [k] = y + o.y;
+    }
+
+    auto dx = out.dx.data ();
+    auto dy = out.dy.data ();
+    auto dz = out.dz.data ();
+    auto count = out.size ();
+    auto i = std::size_t (0u);
+#ifdef I2T_SSE2
+    auto tanfx = _mm_set1_pd ($tanfx), tanfy = _mm_set1_pd (-$tanfy);
+    auto halfw = _mm_set1_pd ($halfw), halfh = _mm_set1_pd ($halfh);
+    auto ux = _mm_set1_pd ($u.x), uy = _mm_set1_pd ($u.y), uz = _mm_set1_pd ($u.z);
+    auto vx = _mm_set1_pd ($v.x), vy = _mm_set1_pd ($v.y), vz = _mm_set1_pd ($v.z);
+    auto wx = _mm_set1_pd ($w.x), wy = _mm_set1_pd ($w.y), wz = _mm_set1_pd ($w.z);
+    auto one = _mm_set1_pd (1.0);
+    for (; i + 2u <= count; i += 2u) {
+        auto alfa = _mm_mul_pd (tanfx, _mm_sub_pd (_mm_loadu_pd (dx + i), halfw));
+        auto beta = _mm_mul_pd (tanfy, _mm_sub_pd (_mm_loadu_pd (dy + i), halfh));
+        auto x = _mm_sub_pd (_mm_add_pd (_mm_mul_pd (alfa, ux), _mm_mul_pd (beta, vx)), wx);
+        auto y = _mm_sub_pd (_mm_add_pd (_mm_mul_pd (alfa, uy), _mm_mul_pd (beta, vy)), wy);
+        auto z = _mm_sub_pd (_mm_add_pd (_mm_mul_pd (alfa, uz), _mm_mul_pd (beta, vz)), wz);
+        auto d = _mm_add_pd (_mm_add_pd (_mm_mul_pd (x, x), _mm_mul_pd (y, y)), _mm_mul_pd (z, z));
+        auto r = _mm_div_pd (one, _mm_sqrt_pd (d));
+        _mm_storeu_pd (dx + i, _mm_mul_pd (x, r));
+        _mm_storeu_pd (dy + i, _mm_mul_pd (y, r));
+        _mm_storeu_pd (dz + i, _mm_mul_pd (z, r));
+    }
+#endif
+    for (; i < count; ++i) {
+        auto alfa = +$tanfx*(dx [i] - $halfw);
+        auto beta = -$tanfy*(dy [i] - $halfh);
+        auto d = normalize (alfa*$u + beta*$v - $w);
+        dx [i] = d.x;
+        dy [i] = d.y;
+        dz [i] = d.z;
+    }
+}
+
+/* Through the pixel edges, widened by a thousandth of a pixel so rays
+   rounded at the edge stay inside. */
+i2t::Frustum i2t::Camera::frustum (int x0, int y0, int x1, int y1) const {
+    static const double MARGIN = 1e-3;
+    auto direction = [this] (double x, double y) {
+        return $tanfx*(x - $halfw)*$u - $tanfy*(y - $halfh)*$v - $w;
+    };
+    dvec3 corners [4] = {
+        direction (x0 - MARGIN, y0 - MARGIN), direction (x1 + MARGIN, y0 - MARGIN),
+        direction (x1 + MARGIN, y1 + MARGIN), direction (x0 - MARGIN, y1 + MARGIN)
+    };
+    auto centre = direction (0.5*(x0 + x1), 0.5*(y0 + y1));
+    Frustum f;
+    f.eye = dvec3 ($eye);
+    for (auto i = 0; i < 4; ++i) {
+        f.normal [i] = cross (corners [i], corners [(i + 1) % 4]);
+        if (dot (f.normal [i], centre) < 0.0)
+            f.normal [i] = -f.normal [i];
+    }
+    return f;
+}
+
+/* A box is outside a plane when even its corner furthest along the 
+   normal is, and inside when even the nearest is. */
+bool i2t::Frustum::excludes (const dvec3& lo, const dvec3& hi) const {
+    for (const auto& n: normal) {
+        auto outer = dvec3 (n.x > 0.0 ? hi.x : lo.x, n.y > 0.0 ? hi.y : lo.y, n.z > 0.0 ? hi.z : lo.z);
+        if (dot (n, outer - eye) < 0.0)
+            return true;
+    }
+    return false;
+}
+
+bool i2t::Frustum::contains (const dvec3& lo, const dvec3& hi) const {
+    for (const auto& n: normal) {
+        auto inner = dvec3 (n.x > 0.0 ? lo.x : hi.x, n.y > 0.0 ? lo.y : hi.y, n.z > 0.0 ? lo.z : hi.z);
+        if (dot (n, inner - eye) < 0.0)
+            return false;
+    }
+    return true;
+}
+
+bool i2t::Camera::project (const dvec3& p, int& x, int& y, double& depth) const {
+    auto d = p - dvec3 ($eye);
+    depth = -dot (d, $w);
+    if (depth <= 0.0)
+        return false;
+    auto fx = std::floor (dot (d, $u)/depth/$tanfx + $halfw);
+    auto fy = std::floor (-dot (d, $v)/depth/$tanfy + $halfh);
+    if (fx < 0.0 || fy < 0.0 || fx >= double ($size.x) || fy >= double ($size.y))
+        return false;
+    x = int (fx);
+    y = int (fy);
+    return true;
+}
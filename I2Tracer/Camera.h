@@ -0,0 +1,73 @@
+#ifndef __CAMERA_H__
+#define __CAMERA_H__
+
+#include "Parser.h"
+#include "Common.h"
+#include <vector>
+
+namespace i2t {
+
+    /* Where the samples of a pixel go. Grid puts them at the centres of an
+       n by n grid, the sample count rounded up to a square for it. Rotated
+       is an n-rooks pattern, one sample in every row and column: a 
+       transposed grid for square counts, a sheared one otherwise. Random 
+       draws new offsets for every pass. */
+    enum class Jitter {
+        none,
+        grid,
+        rotated,
+        random
+    };
+
+    /* Primary rays of a tile as structure of arrays, all starting at the
+       eye. The samples of a pixel are next to each other, pixels go in 
+       rows. */
+    struct RayBatch {
+        std::vector<int> x, y;
+        std::vector<double> dx, dy, dz;
+
+        std::size_t size () const { return x.size (); }
+        void resize (std::size_t count);
+    };
+
+    /* Four planes through the eye, normals pointing in, bounding every 
+       ray through a block of pixels whatever the jitter. */
+    struct Frustum {
+        dvec3 eye;
+        dvec3 normal [4];
+
+        /* Whether a box lies wholly outside, or wholly inside. */
+        bool excludes (const dvec3& lo, const dvec3& hi) const;
+        bool contains (const dvec3& lo, const dvec3& hi) const;
+    };
+
+    /* Pinhole camera with its basis and scale worked out once. */
+    struct Camera {
+        Camera (const SceneData::Camera& camera, unsigned samples = 1u, Jitter jitter = Jitter::none);
+
+        const dvec4& eye () const { return $eye; }
+        unsigned samples () const { return $samples; }
+
+        void generate (int x0, int y0, int x1, int y1, unsigned pass, RayBatch& out) const;
+        Frustum frustum (int x0, int y0, int x1, int y1) const;
+
+        /* Pixel a point lands on and its depth along the view axis. */
+        bool project (const dvec3& p, int& x, int& y, double& depth) const;
+
+    private:
+        dvec2 offset (int x, int y, unsigned sample, unsigned pass) const;
+
+        dvec4 $eye;
+        dvec3 $u, $v, $w;
+        double $tanfx, $tanfy;
+        double $halfw, $halfh;
+        uvec2 $size;
+        unsigned $samples;
+        unsigned $grid;
+        unsigned $shear;
+        Jitter $jitter;
+    };
+
+}
+
+#endif
@@ -0,0 +1,67 @@
+#include "Checkpoint.h"
+#include <cstdio>
+#include <fstream>
+#include <algorithm>
+
+namespace {
+
+    static const std::uint32_t MAGIC = 0x4b433249u;
+    static const std::uint32_t VERSION = 1u;
+
+    struct Header {
+        std::uint32_t magic;
+        std::uint32_t version;
+        std::uint64_t hash;
+        std::uint32_t width, height;
+        std::uint32_t tile_size;
+        std::uint32_t tiles;
+    };
+
+}
+
+/* The file has to be exactly as long as its header says, so a corrupt
+   one can't have it allocate more than the file holds. */
+bool i2t::Checkpoint::load (const std::string& path) {
+    std::ifstream in (path, std::ios::binary | std::ios::ate);
+    auto length = std::uint64_t (std::max<std::streamoff> (in.tellg (), 0));
+    in.seekg (0);
+    Header h;
+    if (!in.read (reinterpret_cast<char*> (&h), sizeof (h)))
+        return false;
+    if (h.magic != MAGIC || h.version != VERSION)
+        return false;
+    auto rest = length - sizeof (h);
+    if (rest < h.tiles || (rest - h.tiles)%sizeof (vec3)
+        || (rest - h.tiles)/sizeof (vec3) != std::uint64_t (h.width)*h.height)
+    {
+        return false;
+    }
+    hash = h.hash;
+    size = uvec2 (h.width, h.height);
+    tile_size = h.tile_size;
+    done.resize (h.tiles);
+    samples.resize (std::size_t (h.width)*h.height);
+    in.read (reinterpret_cast<char*> (done.data ()), done.size ());
+    in.read (reinterpret_cast<char*> (samples.data ()), samples.size ()*sizeof (vec3));
+    return bool (in);
+}
+
+/* Written next to the target and renamed over it, so a kill during the 
+   write leaves the previous checkpoint intact (where rename can't replace
+   an existing file the old one is removed first). */
+bool i2t::Checkpoint::save (const std::string& path) const {
+    auto temp = path + ".tmp";
+    {
+        std::ofstream out (temp, std::ios::binary | std::ios::trunc);
+        Header h = {MAGIC, VERSION, hash, size.x, size.y, tile_size, std::uint32_t (done.size ())};
+        out.write (reinterpret_cast<const char*> (&h), sizeof (h));
+        out.write (reinterpret_cast<const char*> (done.data ()), done.size ());
+        out.write (reinterpret_cast<const char*> (samples.data ()), samples.size ()*sizeof (vec3));
+        if (!out.flush ())
+            return false;
+    }
+    if (std::rename (temp.c_str (), path.c_str ()) == 0)
+        return true;
+    std::remove (path.c_str ());
+    return std::rename (temp.c_str (), path.c_str ()) == 0;
+}
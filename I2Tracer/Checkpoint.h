@@ -0,0 +1,26 @@
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+
+#include "Common.h"
+#include <vector>
+#include <string>
+
+namespace i2t {
+
+    /* On-disk state of an interrupted render: which tiles are finished and
+       the sample buffer they were written to. The hash identifies the scene
+       and render settings the checkpoint belongs to. */
+    struct Checkpoint {
+        std::uint64_t hash = 0u;
+        uvec2 size;
+        unsigned tile_size = 0u;
+        std::vector<std::uint8_t> done;
+        std::vector<vec3> samples;
+
+        bool load (const std::string& path);
+        bool save (const std::string& path) const;
+    };
+
+}
+
+#endif
@@ -0,0 +1,410 @@
+#ifdef _WIN32
+#   define WIN32_LEAN_AND_MEAN
+#   include <winsock2.h>
+#   include <ws2tcpip.h>
+#   pragma comment (lib, "ws2_32.lib")
+#else
+#   include <sys/types.h>
+#   include <sys/socket.h>
+#   include <sys/select.h>
+#   include <netinet/in.h>
+#   include <netinet/tcp.h>
+#   include <arpa/inet.h>
+#   include <netdb.h>
+#   include <unistd.h>
+#endif
+
+#include "Cluster.h"
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <stdexcept>
+
+using namespace i2t;
+
+namespace {
+
+#ifdef _WIN32
+    typedef SOCKET socket_type;
+    typedef int length_type;
+
+    static void close_socket (socket_type s) { closesocket (s); }
+
+    static const struct Winsock {
+        Winsock () { WSADATA data; WSAStartup (MAKEWORD (2, 2), &data); }
+        ~Winsock () { WSACleanup (); }
+    } winsock;
+#else
+    typedef int socket_type;
+    typedef socklen_t length_type;
+
+    static const socket_type INVALID_SOCKET = -1;
+
+    static void close_socket (socket_type s) { ::close (s); }
+#endif
+
+    typedef std::chrono::steady_clock clock;
+
+    static const std::uint32_t MAGIC = 0x57543249u;
+
+    enum : std::uint32_t {
+        HELLO = 1u,
+        BUCKET = 2u,
+        RESULT = 3u,
+        DONE = 4u
+    };
+
+    /* Sent as is, both ends are expected to share the byte order. Hello
+       carries the frame size in w/h and Core::hash () in x/y, low half
+       first. Result is followed by w*h samples. */
+    struct Message {
+        std::uint32_t magic;
+        std::uint32_t type;
+        std::uint32_t id;
+        std::uint32_t x, y, w, h;
+    };
+
+    static_assert (sizeof (vec3) == 3*sizeof (float), "vec3 must be packed");
+
+    static bool send_all (socket_type s, const void* data, std::size_t size) {
+        auto p = reinterpret_cast<const char*> (data);
+        while (size > 0) {
+            auto n = ::send (s, p, int (std::min<std::size_t> (size, 1u << 20)), 0);
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= std::size_t (n);
+        }
+        return true;
+    }
+
+    static bool recv_all (socket_type s, void* data, std::size_t size) {
+        auto p = reinterpret_cast<char*> (data);
+        while (size > 0) {
+            auto n = ::recv (s, p, int (std::min<std::size_t> (size, 1u << 20)), 0);
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= std::size_t (n);
+        }
+        return true;
+    }
+
+    static bool send_message (socket_type s, std::uint32_t type, std::uint32_t id, const Region& r) {
+        Message m = {MAGIC, type, id, r.origin.x, r.origin.y, r.size.x, r.size.y};
+        return send_all (s, &m, sizeof (m));
+    }
+
+    static void set_nodelay (socket_type s) {
+        int one = 1;
+        setsockopt (s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*> (&one), sizeof (one));
+    }
+
+    struct Bucket {
+        Region region;
+        bool done;
+        unsigned assigned;
+        clock::time_point started;
+    };
+
+    struct Worker {
+        socket_type socket;
+        bool ready;
+        int bucket;
+        std::vector<char> buffer;
+    };
+
+    static std::vector<Bucket> make_buckets (const SceneData& scene, unsigned size, const std::vector<Region>& regions) {
+        std::vector<Region> areas (regions);
+        if (areas.empty ())
+            areas.push_back ({uvec2 (0u), scene.camera ().size});
+
+        std::vector<Bucket> buckets;
+        for (const auto& a: areas) {
+            auto x1 = std::min (a.origin.x + a.size.x, scene.camera ().size.x);
+            auto y1 = std::min (a.origin.y + a.size.y, scene.camera ().size.y);
+            for (auto y = a.origin.y; y < y1; y += size)
+            for (auto x = a.origin.x; x < x1; x += size) {
+                Bucket b;
+                b.region.origin = uvec2 (x, y);
+                b.region.size = uvec2 (std::min (size, x1 - x), std::min (size, y1 - y));
+                b.done = false;
+                b.assigned = 0u;
+                buckets.push_back (b);
+            }
+        }
+        return buckets;
+    }
+
+    static socket_type listen_on (unsigned short& port) {
+        auto s = ::socket (AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (s == INVALID_SOCKET)
+            throw std::runtime_error ("Couldn't create socket");
+        int one = 1;
+        setsockopt (s, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*> (&one), sizeof (one));
+        sockaddr_in addr;
+        std::memset (&addr, 0, sizeof (addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl (INADDR_ANY);
+        addr.sin_port = htons (port);
+        if (::bind (s, reinterpret_cast<sockaddr*> (&addr), sizeof (addr)) != 0 || ::listen (s, 64) != 0) {
+            close_socket (s);
+            throw std::runtime_error ("Couldn't listen on port " + std::to_string (port));
+        }
+        length_type length = sizeof (addr);
+        getsockname (s, reinterpret_cast<sockaddr*> (&addr), &length);
+        port = ntohs (addr.sin_port);
+        return s;
+    }
+
+    static socket_type connect_to (const std::string& host, unsigned short port) {
+        addrinfo hints;
+        std::memset (&hints, 0, sizeof (hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* info = nullptr;
+        if (getaddrinfo (host.c_str (), std::to_string (port).c_str (), &hints, &info) != 0)
+            return INVALID_SOCKET;
+        auto s = INVALID_SOCKET;
+        for (auto p = info; p; p = p->ai_next) {
+            s = ::socket (p->ai_family, p->ai_socktype, p->ai_protocol);
+            if (s == INVALID_SOCKET)
+                continue;
+            if (::connect (s, p->ai_addr, length_type (p->ai_addrlen)) == 0)
+                break;
+            close_socket (s);
+            s = INVALID_SOCKET;
+        }
+        freeaddrinfo (info);
+        return s;
+    }
+
+}
+
+RenderProgress i2t::render_coordinator (Core& core, const SceneData& scene,
+    const ClusterOptions& options, const RenderControl& control)
+{
+    auto buckets = make_buckets (scene, std::max (options.bucket_size, 1u), control.regions);
+    auto port = options.port;
+    auto listener = listen_on (port);
+    std::cout << "Coordinator listening on port " << port << "\n";
+
+    /* cmd /c drops the first and last quote of a command starting with
+       one, so on Windows the whole command is quoted once more. */
+    std::vector<std::thread> spawned;
+    std::atomic<unsigned> exited {0u};
+    for (auto i = 0u; i < options.local_workers; ++i) {
+        auto command = options.worker_command + " --worker 127.0.0.1:" + std::to_string (port);
+#ifdef _WIN32
+        command = "\"" + command + "\"";
+#endif
+        spawned.emplace_back ([command, &exited] () {
+            if (std::system (command.c_str ()) != 0)
+                std::cout << "Worker exited with an error\n";
+            ++exited;
+        });
+    }
+
+    std::vector<Worker> workers;
+    auto deadline = clock::now () + control.time_budget;
+    auto status = RenderStatus::complete;
+    std::size_t done = 0u, samples = 0u;
+    auto abandoned = false;
+
+    auto drop = [&] (std::size_t i) {
+        if (workers [i].bucket >= 0)
+            --buckets [workers [i].bucket].assigned;
+        close_socket (workers [i].socket);
+        workers.erase (workers.begin () + i);
+    };
+
+    while (done < buckets.size ()) {
+        if (control.cancel && control.cancel->cancelled ()) {
+            status = RenderStatus::cancelled;
+            break;
+        }
+        if (control.time_budget.count () && clock::now () >= deadline) {
+            status = RenderStatus::out_of_time;
+            break;
+        }
+
+        /* With every local worker gone and none connected, nobody is left
+           to render the rest of the frame, so it's done here. */
+        if (!spawned.empty () && exited == spawned.size ()) {
+            for (auto& t: spawned)
+                t.join ();
+            spawned.clear ();
+            if (workers.empty ()) {
+                abandoned = true;
+                break;
+            }
+        }
+
+        fd_set readable;
+        FD_ZERO (&readable);
+        FD_SET (listener, &readable);
+        auto maxfd = listener;
+        for (const auto& w: workers) {
+            FD_SET (w.socket, &readable);
+            maxfd = std::max (maxfd, w.socket);
+        }
+        timeval tv = {0, 100000};
+        if (select (int (maxfd + 1), &readable, nullptr, nullptr, &tv) < 0)
+            break;
+
+        if (FD_ISSET (listener, &readable)) {
+            auto s = ::accept (listener, nullptr, nullptr);
+            if (s != INVALID_SOCKET) {
+                set_nodelay (s);
+                workers.push_back ({s, false, -1, {}});
+            }
+        }
+
+        for (auto i = workers.size (); i-- > 0;) {
+            auto& w = workers [i];
+            if (!FD_ISSET (w.socket, &readable))
+                continue;
+            char chunk [1u << 16];
+            auto n = ::recv (w.socket, chunk, sizeof (chunk), 0);
+            if (n <= 0) {
+                drop (i);
+                continue;
+            }
+            w.buffer.insert (w.buffer.end (), chunk, chunk + n);
+
+            auto valid = true;
+            while (valid && w.buffer.size () >= sizeof (Message)) {
+                Message m;
+                std::memcpy (&m, w.buffer.data (), sizeof (m));
+                if (m.magic != MAGIC) {
+                    valid = false;
+                    break;
+                }
+                /* A result has to be for the worker's bucket and its size
+                   before its payload is waited for. */
+                if (m.type == RESULT && (m.id >= buckets.size () || int (m.id) != w.bucket
+                    || uvec2 (m.w, m.h) != buckets [m.id].region.size))
+                {
+                    valid = false;
+                    break;
+                }
+                auto payload = m.type == RESULT ? std::size_t (m.w)*m.h*sizeof (vec3) : 0u;
+                if (w.buffer.size () < sizeof (m) + payload)
+                    break;
+                if (m.type == HELLO) {
+                    auto hash = std::uint64_t (m.x) | std::uint64_t (m.y) << 32u;
+                    valid = w.ready = uvec2 (m.w, m.h) == scene.camera ().size && hash == core.hash ();
+                    if (!valid)
+                        std::cout << "Worker rejected, its scene or options differ\n";
+                }
+                else if (m.type == RESULT) {
+                    auto& b = buckets [m.id];
+                    --b.assigned;
+                    w.bucket = -1;
+                    if (!b.done) {
+                        core.write_samples (b.region, reinterpret_cast<const vec3*> (w.buffer.data () + sizeof (m)));
+                        b.done = true;
+                        samples += std::size_t (m.w)*m.h;
+                        ++done;
+                    }
+                }
+                else
+                    valid = false;
+                w.buffer.erase (w.buffer.begin (), w.buffer.begin () + sizeof (m) + payload);
+            }
+            if (!valid)
+                drop (i);
+        }
+
+        auto now = clock::now ();
+        for (auto i = workers.size (); i-- > 0;) {
+            auto& w = workers [i];
+            if (!w.ready || w.bucket >= 0)
+                continue;
+            auto next = -1;
+            for (auto j = 0u; j < buckets.size () && next < 0; ++j)
+                if (!buckets [j].done && !buckets [j].assigned)
+                    next = int (j);
+            for (auto j = 0u; j < buckets.size () && next < 0; ++j)
+                if (!buckets [j].done && buckets [j].assigned < 2u && now - buckets [j].started > options.timeout)
+                    next = int (j);
+            if (next < 0)
+                break;
+            auto& b = buckets [next];
+            if (!send_message (w.socket, BUCKET, std::uint32_t (next), b.region)) {
+                drop (i);
+                continue;
+            }
+            if (!b.assigned)
+                b.started = now;
+            ++b.assigned;
+            w.bucket = next;
+        }
+    }
+
+    for (const auto& w: workers) {
+        send_message (w.socket, DONE, 0u, Region ());
+        close_socket (w.socket);
+    }
+    close_socket (listener);
+    for (auto& t: spawned)
+        t.join ();
+
+    if (abandoned) {
+        std::cout << "No workers left, rendering the rest locally\n";
+        auto local = control;
+        if (control.time_budget.count ())
+            local.time_budget = std::max (std::chrono::milliseconds (1),
+                std::chrono::duration_cast<std::chrono::milliseconds> (deadline - clock::now ()));
+        local.regions.clear ();
+        for (const auto& b: buckets)
+            if (!b.done)
+                local.regions.push_back (b.region);
+        auto rest = core.render (local);
+        status = rest.status;
+        samples += rest.samples;
+        if (rest.status == RenderStatus::complete)
+            done = buckets.size ();
+    }
+
+    RenderProgress progress;
+    progress.status = done == buckets.size () ? RenderStatus::complete : status;
+    progress.tiles_done = done;
+    progress.tiles_total = buckets.size ();
+    progress.samples = samples;
+    return progress;
+}
+
+bool i2t::render_worker (Core& core, const SceneData& scene, const std::string& host, unsigned short port) {
+    auto s = connect_to (host, port);
+    if (s == INVALID_SOCKET) {
+        std::cout << "Couldn't connect to " << host << ":" << port << "\n";
+        return false;
+    }
+    set_nodelay (s);
+
+    auto hash = core.hash ();
+    Region frame = {uvec2 (std::uint32_t (hash), std::uint32_t (hash >> 32u)), scene.camera ().size};
+    auto ok = send_message (s, HELLO, 0u, frame);
+    std::vector<vec3> samples;
+    Message m;
+    while (ok && recv_all (s, &m, sizeof (m))) {
+        if (m.magic != MAGIC || m.type != BUCKET)
+            break;
+        RenderControl control;
+        control.regions.push_back ({uvec2 (m.x, m.y), uvec2 (m.w, m.h)});
+        ok = core.render (control).status == RenderStatus::complete;
+        if (!ok)
+            break;
+        samples.resize (std::size_t (m.w)*m.h);
+        core.read_samples (control.regions.front (), samples.data ());
+        m.type = RESULT;
+        ok = send_all (s, &m, sizeof (m)) && send_all (s, samples.data (), samples.size ()*sizeof (vec3));
+    }
+    close_socket (s);
+    return ok;
+}
@@ -0,0 +1,32 @@
+#ifndef __CLUSTER_H__
+#define __CLUSTER_H__
+
+#include "Core.h"
+#include <string>
+#include <chrono>
+
+namespace i2t {
+
+    /* Bucket rendering over TCP. The coordinator splits the frame into
+       buckets and hands them to worker processes, which render them with
+       their own headless Core and send the samples back. Results are
+       written into the coordinator's Core as they arrive, so snapshot ()
+       shows the frame filling in. Buckets held by a dead worker, or by one
+       slower than the timeout, are handed out again. */
+    struct ClusterOptions {
+        unsigned short port = 0u;
+        unsigned bucket_size = 64u;
+        unsigned local_workers = 0u;
+        std::string worker_command;
+        std::chrono::seconds timeout {60};
+    };
+
+    RenderProgress render_coordinator (Core& core, const SceneData& scene,
+        const ClusterOptions& options, const RenderControl& control);
+
+    bool render_worker (Core& core, const SceneData& scene,
+        const std::string& host, unsigned short port);
+
+}
+
+#endif
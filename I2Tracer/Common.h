@@ -4,10 +4,44 @@
 #define GLM_SWIZZLE
 #include <glm/glm.hpp>
 #include <glm/gtx/transform.hpp>
+#include <cstdint>
+#include <cstddef>
 
 namespace i2t {
     using namespace glm;
 
+    /* FNV-1a, chain calls through h to hash several fields. */
+    inline std::uint64_t hash_bytes (const void* data, std::size_t size, 
+        std::uint64_t h = 14695981039346656037ull) 
+    {
+        auto p = reinterpret_cast<const unsigned char*> (data);
+        for (auto i = 0u; i < size; ++i)
+            h = (h ^ p [i])*1099511628211ull;
+        return h;
+    }
+
+    template <typename _Ttype>
+    inline std::uint64_t hash_value (const _Ttype& value, std::uint64_t h) {
+        return hash_bytes (&value, sizeof (value), h);
+    }
+
+    /* splitmix64, cheap enough to seed one per pixel and pass. */
+    struct Random {
+        explicit Random (std::uint64_t seed): state (seed) {}
+
+        std::uint64_t next () {
+            auto z = (state += 0x9e3779b97f4a7c15ull);
+            z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27))*0x94d049bb133111ebull;
+            return z ^ (z >> 31);
+        }
+
+        double operator () () { 
+            return double (next () >> 11)*(1.0/9007199254740992.0); 
+        }
+
+        std::uint64_t state;
+    };
     
 }
 
@@ -1,19 +1,247 @@
 #include "Core.h"
+#include "Checkpoint.h"
+#include "BvhCache.h"
 #include <omp.h>
 #include <cmath>
 #include <algorithm>
+#include <limits>
+#include <stdexcept>
 #include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 using namespace i2t;
 static const double M_PI = 3.14159265359;
 
 
-i2t::Core::Core (const SceneData& s):
-    scene (s),
+i2t::Core::Core (const SceneData& s, const CoreOptions& o):
     g_width (s.camera ().size.x),
     g_height (s.camera ().size.y),
-    g_samples (std::make_unique<vec3 []>(g_width*g_height))
-{}
+    g_samples (std::make_unique<vec3 []>(g_width*g_height)),
+    scene (s),
+    options (o)
+{
+    if (scene.triangle_count () > scene.triangles ().size () && options.geometry_file.empty ())
+        throw std::runtime_error ("Spilled triangles need a geometry file");
+    build_lights ();
+    g_shadows.reset (options.shadow_cache_cell);
+    if (options.accelerator != Accelerator::bvh) {
+        auto bounds = Bvh::primitive_bounds (scene);
+        if (options.accelerator == Accelerator::grid || Grid::suits (bounds))
+            g_grid.build (bounds);
+    }
+    if (g_grid.empty ()) {
+        auto key = options.bvh_cache.empty () ? 0u : BvhCache::key (scene, options.bvh_quality, 
+            options.bvh_duplication, options.bvh_width, options.bvh_compressed);
+        auto cache = options.bvh_cache.empty () ? std::string () : BvhCache::path (options.bvh_cache, key);
+        if (cache.empty () || !BvhCache::load (cache, key, g_bvh, g_bvh4, g_bvh8, g_qbvh4, g_qbvh8)) {
+            g_bvh.build (scene, options.bvh_quality, options.bvh_duplication);
+            collapse_bvh ();
+            if (!cache.empty ())
+                BvhCache::save (cache, key, g_bvh, g_bvh4, g_bvh8, g_qbvh4, g_qbvh8);
+        }
+    }
+    if (options.sphere_leaves)
+        g_spheres.build (scene, primitive_order ());
+
+    auto same = [] (const SceneData::Material& a, const SceneData::Material& b) {
+        return a.ambient == b.ambient && a.emission == b.emission && a.diffuse == b.diffuse 
+            && a.specular == b.specular && a.power == b.power;
+    };
+    auto primitives = scene.triangle_count () + scene.spheres ().size ();
+    g_material_ids.resize (primitives);
+    for (auto i = 0u; i < primitives; ++i) {
+        const auto& m = scene.material (i);
+        auto id = g_materials.size ();
+        if (i > 0u && same (g_materials [g_material_ids [i - 1u]], m))
+            id = g_material_ids [i - 1u];
+        else for (auto j = 0u; j < g_materials.size () && id == g_materials.size (); ++j)
+            if (same (g_materials [j], m))
+                id = j;
+        if (id == g_materials.size ())
+            g_materials.push_back (m);
+        g_material_ids [i] = std::uint32_t (id);
+    }
+
+    /* The store takes the primitive list along with the vertices, so a
+       traversal's triangles share few blocks. The hierarchy's nodes stay
+       in memory; the grid keeps its list for its mailbox. */
+    if (!options.geometry_file.empty () && scene.triangle_count ()) {
+        if (!g_geometry.create (options.geometry_file, scene, primitive_order (), options.geometry_budget)) {
+            if (scene.triangle_count () > scene.triangles ().size ())
+                throw std::runtime_error ("Couldn't write " + options.geometry_file);
+        }
+        else {
+            scene.release_triangles ();
+            if (g_grid.empty ())
+                g_bvh.release_primitives ();
+        }
+    }
+
+    if (options.gbuffer && options.jitter == Jitter::none) {
+        g_first_hits.reset (new FirstHit [g_width*g_height]);
+        g_reprojected.reset (new FirstHit [g_width*g_height]);
+        for (auto i = 0u; i < g_width*g_height; ++i) {
+            g_first_hits [i].primitive = UNTRACED;
+            g_reprojected [i].primitive = UNTRACED;
+        }
+    }
+    g_pixel_state.reset (new std::uint8_t [g_width*g_height]);
+    std::fill (g_pixel_state.get (), g_pixel_state.get () + g_width*g_height, std::uint8_t (HOLE));
+}
+
+void i2t::Core::collapse_bvh () {
+    if (options.bvh_compressed) {
+        if (options.bvh_width == 8u) {
+            WideBvh<8u> wide;
+            wide.build (g_bvh);
+            g_qbvh8.build (wide);
+        }
+        else {
+            WideBvh<4u> wide;
+            wide.build (g_bvh);
+            g_qbvh4.build (wide);
+        }
+        g_bvh.release_nodes ();
+    }
+    else if (options.bvh_width == 8u)
+        g_bvh8.build (g_bvh);
+    else if (options.bvh_width == 4u)
+        g_bvh4.build (g_bvh);
+}
+
+/* Moved geometry changes every hit and shadow, so the G-buffer and 
+   shadow cache go along with the samples. */
+void i2t::Core::transform (std::uint32_t group, const dmat4& M) {
+    if (g_geometry.enabled ())
+        throw std::runtime_error ("Geometry out of core can't be transformed");
+    scene.transform (group, M);
+    const auto& g = scene.groups () [group];
+    auto triangles = std::uint32_t (scene.triangle_count ());
+    for (auto i = g.triangles_begin; i < g.triangles_end; ++i)
+        g_moved.push_back (i);
+    for (auto i = g.spheres_begin; i < g.spheres_end; ++i)
+        g_moved.push_back (triangles + i);
+    g_shadows.invalidate ();
+    if (g_first_hits) {
+        for (auto i = 0u; i < g_width*g_height; ++i) {
+            g_first_hits [i].primitive = UNTRACED;
+            g_reprojected [i].primitive = UNTRACED;
+        }
+    }
+    mark_stale ();
+}
+
+/* Without the binary nodes, as after compressing, there's nothing to 
+   refit and the hierarchy is built again. The wide copy is refit along
+   with the binary one, unless subtrees were rebuilt and it has to be 
+   collapsed again. */
+void i2t::Core::refit_bvh () {
+    if (!g_grid.empty ())
+        g_grid.build (Bvh::primitive_bounds (scene));
+    else if (g_bvh.nodes ().empty ()) {
+        g_bvh.build (scene, options.bvh_quality, options.bvh_duplication);
+        collapse_bvh ();
+    }
+    else if (g_bvh.refit (scene, g_moved, options.bvh_rebuild))
+        collapse_bvh ();
+    else if (!g_bvh8.empty ())
+        g_bvh8.refit (g_bvh, scene, g_moved);
+    else if (!g_bvh4.empty ())
+        g_bvh4.refit (g_bvh, scene, g_moved);
+    if (options.sphere_leaves)
+        g_spheres.build (scene, primitive_order ());
+    g_moved.clear ();
+}
+
+/* Forward splat of every sample whose point is known into the new view,
+   nearest point wins: the pixel's first hit once traced, otherwise where
+   an earlier move brought its sample from. The points go along with the
+   samples, so a pixel still stale after one move isn't lost to the next.
+   The first hits no longer match their pixels' rays and are cleared. */
+void i2t::Core::set_camera (const SceneData::Camera& camera) {
+    if (camera.size != scene.camera ().size)
+        throw std::runtime_error ("Camera can't change the frame size");
+    scene.set_camera (camera);
+    auto count = g_width*g_height;
+    if (!g_first_hits) {
+        std::fill (g_pixel_state.get (), g_pixel_state.get () + count, std::uint8_t (HOLE));
+        return;
+    }
+
+    Camera view (camera);
+    std::unique_ptr<vec3 []> samples (new vec3 [count]);
+    std::unique_ptr<FirstHit []> points (new FirstHit [count]);
+    std::vector<double> depth (count, std::numeric_limits<double>::infinity ());
+    std::fill (samples.get (), samples.get () + count, vec3 (0.0f));
+    for (auto i = 0u; i < count; ++i)
+        points [i].primitive = UNTRACED;
+    for (auto i = 0u; i < count; ++i) {
+        const auto& traced = g_first_hits [i];
+        const auto& hit = traced.primitive != UNTRACED ? traced : g_reprojected [i];
+        if (hit.primitive == UNTRACED || hit.primitive == MISSED || g_pixel_state [i] == HOLE)
+            continue;
+        int x, y;
+        double z;
+        if (!view.project (hit.point, x, y, z) || z <= EPSILON)
+            continue;
+        auto j = std::size_t (x) + std::size_t (y)*g_width;
+        if (z < depth [j]) {
+            depth [j] = z;
+            samples [j] = g_samples [i];
+            points [j] = hit;
+        }
+    }
+    for (auto i = 0u; i < count; ++i) {
+        g_first_hits [i].primitive = UNTRACED;
+        g_pixel_state [i] = std::isfinite (depth [i]) ? STALE : HOLE;
+    }
+    g_samples = std::move (samples);
+    g_reprojected = std::move (points);
+}
+
+void i2t::Core::build_lights () {
+    std::vector<SceneData::Light> points;
+    g_directional = DirectionalLights ();
+    g_points = PointLights ();
+    for (const auto& light: scene.lights ()) {
+        if (light.position.w == 0.0)
+            g_directional.push_back (light);
+        else
+            points.push_back (light);
+    }
+    for (const auto& light: points)
+        g_points.push_back (light);
+    g_lights.build (points, options.light_cutoff);
+    if (options.light_samples)
+        g_light_tree.build (points);
+}
+
+void i2t::Core::set_material (std::uint32_t id, const SceneData::Material& material) {
+    auto& m = g_materials.at (id);
+    m = material;
+    m.classify ();
+    for (auto i = 0u; i < g_material_ids.size (); ++i)
+        if (g_material_ids [i] == id)
+            scene.set_material (i, m);
+    mark_stale ();
+}
+
+void i2t::Core::mark_stale () {
+    for (auto i = 0u; i < g_width*g_height; ++i)
+        g_pixel_state [i] = std::max (g_pixel_state [i], std::uint8_t (STALE));
+}
+
+/* Only a light that moves changes what's in shadow. */
+void i2t::Core::set_light (std::uint32_t index, const SceneData::Light& light) {
+    auto moved = scene.lights ().at (index).position != light.position;
+    scene.set_light (index, light);
+    build_lights ();
+    if (moved)
+        g_shadows.invalidate ();
+    mark_stale ();
+}
 
 bool i2t::Core::sphere_intersect (
     const dvec3& gRo, const dvec3& gRd,
@@ -115,127 +343,1053 @@ bool i2t::Core::canonical_polygon_intersect (
     return true;
 }
 
-bool i2t::Core::intersect (const dvec3& Ro, const dvec3& Rd, Incident& in) {    
-    auto mint = 1e9;
-    auto hit = false;
-    Incident ti;
+/* Spatial splits can put a primitive in several leaves and a grid in 
+   several cells, the last few tested are remembered so a ray doesn't 
+   test one twice. */
+struct Mailbox {
+    std::uint32_t ids [8];
+    unsigned next = 0u;
+
+    Mailbox () { std::fill (ids, ids + 8, ~0u); }
+
+    bool seen (std::uint32_t id) {
+        for (auto i: ids)
+            if (i == id)
+                return true;
+        ids [next++ & 7u] = id;
+        return false;
+    }
+};
+
+/* 3D-DDA from the cell the ray enters the grid in, one neighbouring 
+   cell at a time. A hit may lie in a cell further on, so cells are 
+   visited until the next starts beyond tmax. */
+template <typename _Leaf>
+void i2t::Core::traverse_grid (const dvec3& Ro, const dvec3& Rd, double tmax, _Leaf&& leaf) const {
+    const auto& cells = g_grid.cells ();
+    const auto& primitives = g_grid.primitives ();
+    const auto& res = g_grid.resolution ();
+    const auto& size = g_grid.cell_size ();
+    const auto& lo = g_grid.lo ();
+    const auto inv = 1.0/Rd;
+    auto t0 = (lo - Ro)*inv;
+    auto t1 = (g_grid.hi () - Ro)*inv;
+    auto tnear = 0.0, tfar = tmax;
+    for (auto i = 0; i < 3; ++i) {
+        tnear = std::max (tnear, std::min (t0 [i], t1 [i]));
+        tfar = std::min (tfar, std::max (t0 [i], t1 [i]));
+    }
+    if (!(tnear <= tfar))
+        return;
+
+    auto cell = clamp (ivec3 (floor ((Ro + tnear*Rd - lo)*g_grid.inv_cell ())), ivec3 (0), res - 1);
+    ivec3 step, end;
+    dvec3 next, delta;
+    for (auto i = 0; i < 3; ++i) {
+        step [i] = Rd [i] > 0.0 ? 1 : Rd [i] < 0.0 ? -1 : 0;
+        end [i] = step [i] > 0 ? res [i] : -1;
+        next [i] = step [i] ? (lo [i] + (cell [i] + (step [i] > 0))*size [i] - Ro [i])*inv [i] 
+            : std::numeric_limits<double>::infinity ();
+        delta [i] = step [i] ? size [i]*std::abs (inv [i]) : std::numeric_limits<double>::infinity ();
+    }
+
+    Mailbox mailbox;
+    for (;;) {
+        auto c = g_grid.index (cell);
+        for (auto i = cells [c]; i < cells [c + 1u]; ++i)
+            if (!mailbox.seen (primitives [i]) && leaf (i, 1u, tmax))
+                return;
+        auto axis = next.x < next.y ? (next.x < next.z ? 0 : 2) : (next.y < next.z ? 1 : 2);
+        if (next [axis] > tmax)
+            return;
+        cell [axis] += step [axis];
+        if (cell [axis] == end [axis])
+            return;
+        next [axis] += delta [axis];
+    }
+}
 
-    for (const auto& obj: scene.triangles ()) {        
-        if (!polygon_intersect (Ro, Rd, obj.v0.xyz, obj.v1.xyz, obj.v2.xyz, ti))
+template <typename _Wide, typename _Leaf>
+void i2t::Core::traverse_wide (const _Wide& bvh, const dvec3& Ro, const dvec3& Rd, double tmax, _Leaf&& leaf, 
+    const std::vector<Subtree>* roots) const 
+{
+    static const auto width = sizeof (bvh.nodes () [0].child)/sizeof (std::uint32_t);
+    const auto& nodes = bvh.nodes ();
+    const auto ray = _Wide::ray (Ro, Rd);
+
+    /* Hit children go on the stack farthest first, so the nearest is
+       popped next. Entries are dropped on the way out once tmax has 
+       moved in front of them. Each level down leaves at most width - 1
+       siblings behind, over at most Bvh::MAX_DEPTH levels. */
+    Subtree stack [(width - 1u)*Bvh::MAX_DEPTH + MAX_SUBTREES];
+    auto top = 0u;
+    if (roots) {
+        for (const auto& r: *roots)
+            stack [top++] = r;
+    }
+    else
+        stack [top++] = {0u, 0u, 0.0};
+    while (top) {
+        auto e = stack [--top];
+        if (e.t > tmax)
             continue;
-        if (ti.t <= EPSILON)
+        if (e.count) {
+            if (leaf (e.child, e.count, tmax))
+                return;
             continue;
-        if (ti.t < mint) {
-            mint = ti.t;
-            ti.material = obj.material;
-            in = ti;
-            hit = true;
+        }
+        const auto& node = nodes [e.child];
+        double tnear [width];
+        auto mask = _Wide::enter (node, ray, tmax, tnear);
+        auto first = top;
+        for (auto i = 0u; mask; ++i, mask >>= 1u) {
+            if (!(mask & 1u))
+                continue;
+            Subtree c = {node.child [i], node.count [i], tnear [i]};
+            auto j = top++;
+            for (; j > first && stack [j - 1u].t < c.t; --j)
+                stack [j] = stack [j - 1u];
+            stack [j] = c;
         }
     }
+}
 
-    for (const auto& obj: scene.spheres ()) {
-        Incident ti;
-        if (!sphere_intersect (Ro, Rd, obj.inverseT, obj.T, ti))
-            continue;
-        if (ti.t <= EPSILON)
-            continue;
-        if (ti.t < mint) {
-            mint = ti.t;
-            ti.material = obj.material;
-            in = ti;
-            hit = true;
+template <typename _Leaf>
+void i2t::Core::traverse (const dvec3& Ro, const dvec3& Rd, double tmax, _Leaf&& leaf, 
+    const std::vector<Subtree>* roots) const 
+{
+    if (!g_grid.empty ())
+        return traverse_grid (Ro, Rd, tmax, leaf);
+    if (!g_qbvh8.empty ())
+        return traverse_wide (g_qbvh8, Ro, Rd, tmax, leaf, roots);
+    if (!g_qbvh4.empty ())
+        return traverse_wide (g_qbvh4, Ro, Rd, tmax, leaf, roots);
+    if (!g_bvh8.empty ())
+        return traverse_wide (g_bvh8, Ro, Rd, tmax, leaf, roots);
+    if (!g_bvh4.empty ())
+        return traverse_wide (g_bvh4, Ro, Rd, tmax, leaf, roots);
+    if (g_bvh.empty ())
+        return;
+    const auto& nodes = g_bvh.nodes ();
+    const auto inv = 1.0/Rd;
+
+    /* Slab test, NaNs from a ray lying in a slab plane are dropped by
+       the argument order of min and max. */
+    auto enter = [&] (const Bvh::Node& node, double tmax) {
+        auto t0 = (node.lo - Ro)*inv;
+        auto t1 = (node.hi - Ro)*inv;
+        auto tnear = 0.0, tfar = tmax;
+        for (auto i = 0; i < 3; ++i) {
+            tnear = std::max (tnear, std::min (t0 [i], t1 [i]));
+            tfar = std::min (tfar, std::max (t0 [i], t1 [i]));
         }
+        return tnear <= tfar ? tnear : -1.0;
+    };
+
+    /* One sibling is left behind per level down. */
+    std::uint32_t stack [Bvh::MAX_DEPTH + MAX_SUBTREES];
+    auto top = 0u;
+    if (roots) {
+        for (const auto& r: *roots)
+            stack [top++] = r.child;
+    }
+    else if (enter (nodes [0], tmax) >= 0.0)
+        stack [top++] = 0u;
+    if (!top)
+        return;
+    auto node = stack [--top];
+    for (;;) {
+        const auto& n = nodes [node];
+        if (n.count) {
+            if (leaf (n.offset, n.count, tmax))
+                return;
+        }
+        else {
+            auto a = node + 1u, b = n.offset;
+            auto ta = enter (nodes [a], tmax);
+            auto tb = enter (nodes [b], tmax);
+            if (ta >= 0.0 && tb >= 0.0) {
+                if (tb < ta)
+                    std::swap (a, b);
+                stack [top++] = b;
+                node = a;
+                continue;
+            }
+            if (ta >= 0.0 || tb >= 0.0) {
+                node = ta >= 0.0 ? a : b;
+                continue;
+            }
+        }
+        if (!top)
+            return;
+        node = stack [--top];
+    }
+}
+
+/* Breadth first from the root: an inner node partly inside the frustum
+   is replaced by those of its children the frustum doesn't exclude, for
+   as long as the list has room for them all. expand (node, push) pushes
+   a node's children as (child, count, box). t is the distance from the 
+   eye to a subtree's box, which no ray reaches it before. */
+template <typename _Expand>
+static void refine (const Frustum& frustum, std::size_t width, std::vector<Core::Subtree>& out, _Expand&& expand) {
+    struct Item {
+        Core::Subtree subtree;
+        bool open;
+        bool split;
+    };
+    std::vector<Item> items;
+    auto push = [&] (std::uint32_t child, std::uint32_t count, const Bounds& box) {
+        if (frustum.excludes (box.lo, box.hi))
+            return;
+        auto gap = max (max (box.lo - frustum.eye, frustum.eye - box.hi), dvec3 (0.0));
+        Item item = {{child, count, length (gap)}, !count && !frustum.contains (box.lo, box.hi), false};
+        items.push_back (item);
+    };
+    expand (0u, push);
+    auto live = items.size ();
+    for (auto i = 0u; i < items.size (); ++i) {
+        if (!items [i].open || live + width - 1u > Core::MAX_SUBTREES)
+            continue;
+        items [i].split = true;
+        auto before = items.size ();
+        expand (items [i].subtree.child, push);
+        live += items.size () - before - 1u;
     }
+    out.clear ();
+    for (const auto& item: items)
+        if (!item.split)
+            out.push_back (item.subtree);
+    std::sort (out.begin (), out.end (), [] (const Core::Subtree& a, const Core::Subtree& b) { return a.t > b.t; });
+}
+
+template <typename _Wide>
+static void refine_wide (const _Wide& bvh, const Frustum& frustum, std::vector<Core::Subtree>& out) {
+    static const auto width = sizeof (bvh.nodes () [0].child)/sizeof (std::uint32_t);
+    refine (frustum, width, out, [&] (std::uint32_t index, auto&& push) {
+        const auto& node = bvh.nodes () [index];
+        for (auto i = 0u; i < node.children; ++i)
+            push (node.child [i], std::uint32_t (node.count [i]), _Wide::bounds (node, i));
+    });
+}
+
+/* Binary leaves come out with their count too, which the binary 
+   traversal doesn't need. */
+void i2t::Core::cull (const Frustum& frustum, std::vector<Subtree>& out) const {
+    out.clear ();
+    if (!g_qbvh8.empty ())
+        return refine_wide (g_qbvh8, frustum, out);
+    if (!g_qbvh4.empty ())
+        return refine_wide (g_qbvh4, frustum, out);
+    if (!g_bvh8.empty ())
+        return refine_wide (g_bvh8, frustum, out);
+    if (!g_bvh4.empty ())
+        return refine_wide (g_bvh4, frustum, out);
+    if (g_bvh.empty ())
+        return;
+    const auto& nodes = g_bvh.nodes ();
+    refine (frustum, 2u, out, [&] (std::uint32_t index, auto&& push) {
+        const auto& n = nodes [index];
+        if (n.count) {
+            push (index, n.count, Bounds {n.lo, n.hi});
+            return;
+        }
+        for (auto child: {index + 1u, n.offset})
+            push (child, nodes [child].count, Bounds {nodes [child].lo, nodes [child].hi});
+    });
+}
+
+/* Equal distances go to the lower primitive number, so the result doesn't 
+   depend on traversal order. Rays in a triangle's plane come back with a 
+   NaN distance, which the comparisons have to reject. */
+bool i2t::Core::intersect (const dvec3& Ro, const dvec3& Rd, Incident& in, const std::vector<Subtree>* roots) {
+    static const auto width = SphereLeaves::WIDTH;
+    const auto triangles = std::uint32_t (scene.triangle_count ());
+    const auto& primitives = primitive_order ();
+    auto hit = false;
+    GeometryStore::Cursor cursor;
+    auto primitive = [&] (std::uint32_t k) {
+        return g_geometry.enabled () ? g_geometry.entry (k, cursor).primitive : primitives [k];
+    };
+    auto accept = [&] (std::uint32_t id, Incident& ti, double& mint) {
+        auto closer = ti.t < mint || (ti.t == mint && (!hit || id < in.primitive));
+        if (!(ti.t > EPSILON && closer))
+            return;
+        mint = ti.t;
+        ti.material = g_materials [g_material_ids [id]];
+        ti.primitive = id;
+        in = ti;
+        hit = true;
+    };
+    traverse (Ro, Rd, 1e9, [&] (std::uint32_t first, std::uint32_t count, double& mint) {
+        for (auto k = first; k < first + count; k += width) {
+            auto lanes = std::min (first + count - k, width);
+            auto round = g_spheres.round (k, lanes);
 
+            /* Only the nearest of the round spheres is worked out in full. */
+            double t [width];
+            auto hits = round ? g_spheres.intersect (k, Ro, Rd, EPSILON, mint, t) & round : 0u;
+            auto best = ~0u;
+            for (auto j = 0u; j < lanes; ++j)
+                if ((hits >> j & 1u) && (best == ~0u || t [j] < t [best] 
+                    || (t [j] == t [best] && primitive (k + j) < primitive (k + best))))
+                    best = j;
+            if (best != ~0u) {
+                Incident ti;
+                auto id = primitive (k + best);
+                const auto& obj = scene.spheres () [id - triangles];
+                if (sphere_intersect (Ro, Rd, obj.inverseT, obj.T, ti))
+                    accept (id, ti, mint);
+            }
+
+            for (auto j = 0u; j < lanes; ++j) {
+                if (round >> j & 1u)
+                    continue;
+                Incident ti;
+                auto id = primitive (k + j);
+                if (id == GeometryStore::MISSING)
+                    continue;
+                if (id < triangles && g_geometry.enabled ()) {
+                    const auto& obj = g_geometry.entry (k + j, cursor);
+                    if (!polygon_intersect (Ro, Rd, obj.v0, obj.v1, obj.v2, ti))
+                        continue;
+                }
+                else if (id < triangles) {
+                    const auto& obj = scene.triangles () [id];
+                    if (!polygon_intersect (Ro, Rd, obj.v0.xyz, obj.v1.xyz, obj.v2.xyz, ti))
+                        continue;
+                }
+                else {
+                    const auto& obj = scene.spheres () [id - triangles];
+                    if (!sphere_intersect (Ro, Rd, obj.inverseT, obj.T, ti))
+                        continue;
+                }
+                accept (id, ti, mint);
+            }
+        }
+        return false;
+    }, roots);
     return hit;
 }
 
+/* Round spheres skip the mailbox, testing a batch costs less than 
+   looking its primitives up. */
 bool i2t::Core::intersect (const dvec3& Ro, const dvec3& Rd, double tmax) {
-    double t;
-    for (const auto& obj: scene.triangles ()) {        
-        if (canonical_polygon_intersect (Ro, Rd, obj.v0.xyz, obj.v1.xyz, obj.v2.xyz, t))
-            if (t > EPSILON && t <= tmax - EPSILON) 
-                return true;
+    static const auto width = SphereLeaves::WIDTH;
+    const auto triangles = std::uint32_t (scene.triangle_count ());
+    const auto positions = g_geometry.enabled () && g_grid.empty () ? g_geometry.size () : g_bvh.primitives ().size ();
+    const auto duplicates = positions > triangles + scene.spheres ().size ();
+    const auto& primitives = primitive_order ();
+    auto hit = false;
+    Mailbox mailbox;
+    GeometryStore::Cursor cursor;
+    auto primitive = [&] (std::uint32_t k) {
+        return g_geometry.enabled () ? g_geometry.entry (k, cursor).primitive : primitives [k];
+    };
+    traverse (Ro, Rd, tmax, [&] (std::uint32_t first, std::uint32_t count, double&) {
+        for (auto k = first; k < first + count; k += width) {
+            auto lanes = std::min (first + count - k, width);
+            auto round = g_spheres.round (k, lanes);
+            double ts [width];
+            if (round && (g_spheres.intersect (k, Ro, Rd, EPSILON, tmax - EPSILON, ts) & round))
+                return hit = true;
+
+            for (auto j = 0u; j < lanes; ++j) {
+                if (round >> j & 1u)
+                    continue;
+                auto id = primitive (k + j);
+                if (id == GeometryStore::MISSING || (duplicates && mailbox.seen (id)))
+                    continue;
+                double t;
+                if (id < triangles && g_geometry.enabled ()) {
+                    const auto& obj = g_geometry.entry (k + j, cursor);
+                    if (!canonical_polygon_intersect (Ro, Rd, obj.v0, obj.v1, obj.v2, t))
+                        continue;
+                }
+                else if (id < triangles) {
+                    const auto& obj = scene.triangles () [id];
+                    if (!canonical_polygon_intersect (Ro, Rd, obj.v0.xyz, obj.v1.xyz, obj.v2.xyz, t))
+                        continue;
+                }
+                else {
+                    const auto& obj = scene.spheres () [id - triangles];
+                    if (!simple_sphere_intersect (Ro, Rd, obj.inverseT, obj.T, t))
+                        continue;
+                }
+                if (t > EPSILON && t <= tmax - EPSILON)
+                    return hit = true;
+            }
+        }
+        return false;
+    });
+    return hit;
+}
+
+void i2t::Core::store_sample (unsigned x, unsigned y, vec3 sample, unsigned pass) {
+    auto& s = g_samples [x + y*scene.camera ().size.x];
+    s = pass ? mix (s, sample, 1.0f/(pass + 1u)) : sample;
+}
+
+/* Lights are numbered with directional ones after all the point lights. */
+bool i2t::Core::occluded (const dvec3& P, std::uint32_t primitive, std::uint32_t light, const dvec3& L, double tmax) {
+    if (!g_shadows.enabled ())
+        return intersect (P, L, tmax);
+    auto key = g_shadows.key (primitive, light, P);
+    bool hidden;
+    if (!g_shadows.find (key, hidden)) {
+        hidden = intersect (P, L, tmax);
+        g_shadows.insert (key, hidden);
     }
-    for (const auto& obj: scene.spheres ()) {
-        if (simple_sphere_intersect (Ro, Rd, obj.inverseT, obj.T, t))
-            if (t > EPSILON && t <= tmax - EPSILON)
-                return true;
+    return hidden;
+}
+
+/* Directional lights don't fall off and their shadow rays never end. */
+template <unsigned _Shading, typename _Visit>
+void i2t::Core::shade_directional (const Incident& ti, const dvec4& ED, _Visit&& visit) {
+    static const auto infinity = std::numeric_limits<double>::infinity ();
+    const auto& D = ti.material.diffuse;
+    const auto& S = ti.material.specular;
+    const auto s = ti.material.power;
+    const auto N = dvec3 (ti.normal);
+    const auto V = dvec3 (ED);
+    const auto& L = g_directional;
+
+    for (auto i = 0u; i < L.size (); ++i) {
+        auto Ld = dvec3 (L.x [i], L.y [i], L.z [i]);
+        auto f = vec3 (0.0f);
+        if (_Shading & SceneData::Material::DIFFUSE)
+            f += D*float (std::max (dot (N, Ld), 0.0));
+        if (_Shading & SceneData::Material::SPECULAR)
+            f += S*float (std::pow (std::max (dot (N, normalize (V + Ld)), 0.0), s));
+        auto C = vec3 (L.r [i], L.g [i], L.b [i])*f;
+        auto peak = max (C.r, max (C.g, C.b));
+        if (peak <= 0.0f || peak < options.light_cutoff)
+            continue;
+        visit (Ld, infinity, C, std::uint32_t (g_points.size () + i));
     }
-    return false;
 }
 
-void i2t::Core::store_sample (unsigned x, unsigned y, vec3 sample) {
-    g_samples [x + y*scene.camera ().size.x] = sample;
+/* Point lights go in batches: the unshadowed contributions are worked out 
+   for the whole batch without branches, then only the lights that are 
+   worth a shadow ray are passed on. Weights, when given, scale each light
+   before the cutoff is applied; lights it drops are lost rather than 
+   made up for, so the cutoff biases sampled lighting as it does the 
+   exhaustive kind. */
+template <unsigned _Shading, typename _Visit>
+void i2t::Core::shade_points (const std::uint32_t* index, const float* weight, std::size_t count,
+    const Incident& ti, const dvec4& ED, float cutoff, _Visit&& visit)
+{
+    const auto& D = ti.material.diffuse;
+    const auto& S = ti.material.specular;
+    const auto s = ti.material.power;
+    const auto P = dvec3 (ti.point);
+    const auto N = dvec3 (ti.normal);
+    const auto V = dvec3 (ED);
+    const auto& L = g_points;
+
+    double lx [LIGHT_BATCH], ly [LIGHT_BATCH], lz [LIGHT_BATCH], lr [LIGHT_BATCH];
+    float ir [LIGHT_BATCH], ig [LIGHT_BATCH], ib [LIGHT_BATCH];
+    bool live [LIGHT_BATCH];
+
+    for (std::size_t first = 0u; first < count; first += LIGHT_BATCH) {
+        auto n = std::min<std::size_t> (LIGHT_BATCH, count - first);
+        for (std::size_t j = 0u; j < n; ++j) {
+            auto i = index [first + j];
+            auto dx = L.x [i] - P.x;
+            auto dy = L.y [i] - P.y;
+            auto dz = L.z [i] - P.z;
+            auto r2 = dx*dx + dy*dy + dz*dz;
+            auto r = std::sqrt (r2);
+            dx /= r;
+            dy /= r;
+            dz /= r;
+            auto fr = 0.0f, fg = 0.0f, fb = 0.0f;
+            if (_Shading & SceneData::Material::DIFFUSE) {
+                auto kd = float (std::max (N.x*dx + N.y*dy + N.z*dz, 0.0));
+                fr += D.r*kd;
+                fg += D.g*kd;
+                fb += D.b*kd;
+            }
+            if (_Shading & SceneData::Material::SPECULAR) {
+                auto hx = V.x + dx;
+                auto hy = V.y + dy;
+                auto hz = V.z + dz;
+                auto h = std::sqrt (hx*hx + hy*hy + hz*hz);
+                auto ks = float (std::pow (std::max ((N.x*hx + N.y*hy + N.z*hz)/h, 0.0), s));
+                fr += S.r*ks;
+                fg += S.g*ks;
+                fb += S.b*ks;
+            }
+            auto a = (weight ? weight [first + j] : 1.0f)/float (L.c0 [i] + L.c1 [i]*r + L.c2 [i]*r2);
+            ir [j] = L.r [i]*a*fr;
+            ig [j] = L.g [i]*a*fg;
+            ib [j] = L.b [i]*a*fb;
+            auto peak = std::max (ir [j], std::max (ig [j], ib [j]));
+            live [j] = peak > 0.0f && peak >= cutoff;
+            lx [j] = dx;
+            ly [j] = dy;
+            lz [j] = dz;
+            lr [j] = r;
+        }
+        for (std::size_t j = 0u; j < n; ++j) {
+            if (live [j])
+                visit (dvec3 (lx [j], ly [j], lz [j]), lr [j], vec3 (ir [j], ig [j], ib [j]), index [first + j]);
+        }
+    }
+}
+
+/* Everything at a hit short of the reflection: the constant terms are 
+   returned, each light worth a shadow ray goes to visit with its 
+   direction, distance, unshadowed contribution and number. */
+template <unsigned _Shading, typename _Visit>
+vec3 i2t::Core::shade_local (const dvec4& Ro, const Incident& ti, Random& rng, _Visit&& visit) {
+    const auto& A = ti.material.ambient;
+    const auto& E = ti.material.emission;
+    const auto& N = ti.normal;
+
+    if (_Shading == SceneData::Material::EMISSIVE)
+        return A + E;
+    
+    auto ED = normalize (Ro - ti.point);
+    shade_directional<_Shading> (ti, ED, visit);
+    if (options.light_samples) {
+        auto oriented = !(_Shading & SceneData::Material::SPECULAR);
+        std::uint32_t index [LIGHT_BATCH];
+        float weight [LIGHT_BATCH];
+        for (auto k = 0u; k < options.light_samples; k += LIGHT_BATCH) {
+            auto n = 0u;
+            for (auto j = k; j < std::min (k + LIGHT_BATCH, options.light_samples); ++j) {
+                double pdf;
+                if (!g_light_tree.sample (ti.point.xyz, N.xyz, oriented, rng (), index [n], pdf))
+                    continue;
+                weight [n++] = float (1.0/(pdf*options.light_samples));
+            }
+            shade_points<_Shading> (index, weight, n, ti, ED, options.light_cutoff, visit);
+        }
+    }
+    else {
+        auto unbounded = g_lights.unbounded ();
+        auto cell = g_lights.cell (ti.point.xyz);
+        shade_points<_Shading> (unbounded.first, nullptr, unbounded.last - unbounded.first, ti, ED, options.light_cutoff, visit);
+        shade_points<_Shading> (cell.first, nullptr, cell.last - cell.first, ti, ED, options.light_cutoff, visit);
+    }
+    return A + E;
+}
+
+template <typename _Visit>
+vec3 i2t::Core::shade_lights (const dvec4& Ro, const Incident& ti, Random& rng, _Visit&& visit) {
+    typedef SceneData::Material Material;
+    switch (ti.material.shading) {
+    case Material::EMISSIVE: 
+        return shade_local<Material::EMISSIVE> (Ro, ti, rng, visit);
+    case Material::DIFFUSE: 
+        return shade_local<Material::DIFFUSE> (Ro, ti, rng, visit);
+    case Material::SPECULAR: 
+        return shade_local<Material::SPECULAR> (Ro, ti, rng, visit);
+    default: 
+        return shade_local<Material::PHONG> (Ro, ti, rng, visit);
+    }
 }
 
-vec3 i2t::Core::render_sample (const dvec4& Ro, const dvec4& Rd, int bounces) {
+/* Decides whether a reflection ray follows the hit, and gives its 
+   direction and the throughput it carries. */
+bool i2t::Core::next_bounce (const dvec4& Rd, const Incident& ti, int bounces, 
+    const vec3& throughput, Random& rng, dvec4& rd, vec3& weight, vec3& next)
+{
+    const auto& S = ti.material.specular;
+    if (!(ti.material.shading & SceneData::Material::SPECULAR))
+        return false;
+    next = throughput*S;
+    auto live = max (next.r, max (next.g, next.b));
+    if (live < options.throughput_cutoff)
+        return false;
+    weight = S;
+    if (options.roulette_depth && bounces <= int (scene.bounces ()) - int (options.roulette_depth) && live < 1.0f) {
+        if (float (rng ()) >= live)
+            return false;
+        weight /= live;
+        next /= live;
+    }
+    rd = normalize (reflect (Rd, ti.normal));
+    return true;
+}
+
+template <unsigned _Shading>
+vec3 i2t::Core::shade (const dvec4& Ro, const dvec4& Rd, const Incident& ti, int bounces, const vec3& throughput, Random& rng) {
+    auto I = vec3 (0.0f);
+    auto local = shade_local<_Shading> (Ro, ti, rng, 
+        [&] (const dvec3& L, double tmax, const vec3& C, std::uint32_t light) {
+            if (!occluded (ti.point.xyz, ti.primitive, light, L, tmax))
+                I += C;
+        });
+    I = local + I;
+    dvec4 rRd;
+    vec3 weight, T;
+    if (!(_Shading & SceneData::Material::SPECULAR) || !next_bounce (Rd, ti, bounces, throughput, rng, rRd, weight, T))
+        return I;
+    return I + weight*render_sample (ti.point, rRd, bounces-1, T, rng);
+}
+
+vec3 i2t::Core::render_sample (const dvec4& Ro, const dvec4& Rd, int bounces, const vec3& throughput, Random& rng) {
     if (bounces <= 0)
         return vec3 (0.0);
     Incident ti;
     if (!intersect (Ro.xyz, Rd.xyz, ti))
         return vec3 (0.0);
-    
+    return shade_hit (Ro, Rd, ti, bounces, throughput, rng);
+}
 
-    const auto& A = ti.material.ambient;
-    const auto& E = ti.material.emission;
-    const auto& D = ti.material.diffuse;
-    const auto& S = ti.material.specular;
-    const auto& s = ti.material.power;
-    const auto& N = ti.normal;
-    
-    
-    auto ED = normalize (Ro - ti.point);
-    auto I = A + E;
+/* Same as render_sample for a primary ray, tracing from the tile's roots
+   if culled. With a G-buffer the hit comes from there once the pixel has
+   been traced. The material is looked up again, so edits since then 
+   show. */
+vec3 i2t::Core::render_primary (std::size_t pixel, const dvec4& Ro, const dvec4& Rd, Random& rng, 
+    const std::vector<Subtree>* roots) 
+{
+    if (scene.bounces () <= 0)
+        return vec3 (0.0);
+    Incident ti;
+    auto hit = g_first_hits 
+        ? primary_hit (pixel, Ro, Rd, ti, roots) 
+        : intersect (Ro.xyz, Rd.xyz, ti, roots);
+    if (!hit)
+        return vec3 (0.0);
+    return shade_hit (Ro, Rd, ti, scene.bounces (), vec3 (1.0f), rng);
+}
+
+bool i2t::Core::primary_hit (std::size_t pixel, const dvec4& Ro, const dvec4& Rd, Incident& ti, 
+    const std::vector<Subtree>* roots) 
+{
+    auto& hit = g_first_hits [pixel];
+    if (hit.primitive == UNTRACED) {
+        if (intersect (Ro.xyz, Rd.xyz, ti, roots)) {
+            hit.point = dvec3 (ti.point);
+            hit.normal = dvec3 (ti.normal);
+            hit.primitive = ti.primitive;
+        }
+        else
+            hit.primitive = MISSED;
+    }
+    if (hit.primitive == MISSED)
+        return false;
+    ti.point = dvec4 (hit.point, 1.0);
+    ti.normal = dvec4 (hit.normal, 0.0);
+    ti.t = distance (hit.point, dvec3 (Ro));
+    ti.primitive = hit.primitive;
+    ti.material = g_materials [g_material_ids [hit.primitive]];
+    return true;
+}
+
+/* Hashed rather than spaced along the generator's own sequence, where
+   one pixel's k-th number would be a neighbour's first. */
+std::uint64_t i2t::Core::ray_seed (int x, int y, unsigned sample, unsigned pass) const {
+    auto pixel = std::uint64_t (x) + std::uint64_t (y)*g_width;
+    return hash_value (sample, hash_value (pass, hash_value (pixel, 14695981039346656037ull)));
+}
+
+/* Spreads the low four bits of v three apart. */
+static std::uint32_t spread4 (std::uint32_t v) {
+    auto r = 0u;
+    for (auto i = 0u; i < 4u; ++i)
+        r |= ((v >> i) & 1u) << (3u*i);
+    return r;
+}
 
-    for (const auto& light: scene.lights ()) {        
-        auto is_directional = light.position.w == 0.0;
-        auto Li = light.color;
-        auto L = is_directional ? light.position : light.position - ti.point;
-        auto r = length (L);        
-        L = normalize (L);
-        auto H = normalize (ED+L) ;                
-        auto V = intersect (ti.point.xyz, dvec3 (L.xyz), r) ? 0.0f : 1.0f;        
-        const auto& C = light.attenuation;
-        auto c = float (C [0] + C [1]*r + C [2]*r*r);
-        auto diff = D*float (std::max (dot (N, L), 0.0));
-        auto spec = S*float (std::pow (std::max (dot (N, H), 0.0), s));
-        I += (V*Li/c)*(diff + spec);        
+/* Direction octant on top, then the origin's cell in a 16^3 grid over 
+   the origins being sorted, in Morton order. Ties keep their order. */
+template <typename _Ttype, typename _Key>
+static void sort_stream (std::vector<_Ttype>& items, std::vector<_Ttype>& scratch, _Key&& key) {
+    if (items.size () < 2u)
+        return;
+    auto lo = dvec3 (std::numeric_limits<double>::max ());
+    auto hi = -lo;
+    for (const auto& item: items) {
+        lo = min (lo, key (item).first);
+        hi = max (hi, key (item).first);
+    }
+    auto scale = 16.0/max (hi - lo, dvec3 (1e-9));
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> keys (items.size ());
+    for (auto i = 0u; i < items.size (); ++i) {
+        auto k = key (items [i]);
+        auto c = clamp (ivec3 ((k.first - lo)*scale), ivec3 (0), ivec3 (15));
+        auto octant = (k.second.x < 0.0 ? 1u : 0u) | (k.second.y < 0.0 ? 2u : 0u) | (k.second.z < 0.0 ? 4u : 0u);
+        keys [i].first = (octant << 12u) | spread4 (c.x) | (spread4 (c.y) << 1u) | (spread4 (c.z) << 2u);
+        keys [i].second = i;
     }
-    auto rRd = normalize (reflect (Rd, N));
-    auto rRo = ti.point;
-    return I + S*render_sample (rRo, rRd, bounces-1);
+    std::sort (keys.begin (), keys.end ());
+    scratch.clear ();
+    for (const auto& k: keys)
+        scratch.push_back (items [k.second]);
+    std::swap (items, scratch);
 }
 
-void i2t::Core::render () {    
+/* Every STRIDE-th ray of a queue about to be traced is walked through
+   the nodes alone, and the store reads the entries of the first LEAVES
+   leaves it enters, the nearest, in the background. Queues are sorted,
+   or a tile's primary rays, so the rays between mostly reach the same
+   leaves. ray (i) gives the ith ray's origin and direction. */
+template <typename _Ray>
+void i2t::Core::prefetch (std::size_t count, _Ray&& ray) {
+    static const std::size_t STRIDE = 16u;
+    static const unsigned LEAVES = 4u;
+    if (!g_geometry.enabled ())
+        return;
+    for (auto i = std::size_t (0u); i < count; i += STRIDE) {
+        auto r = ray (i);
+        auto leaves = 0u;
+        traverse (r.first, r.second, 1e9, [&] (std::uint32_t first, std::uint32_t entries, double&) {
+            g_geometry.prefetch (first, entries);
+            return ++leaves >= LEAVES;
+        });
+    }
+}
+
+/* Breadth first version of render_sample over a tile's rays. Each bounce
+   is sorted, traced and shaded, then the shadow rays it produced are 
+   sorted and traced, then the reflection rays become the next bounce. */
+void i2t::Core::render_stream (const RayBatch& rays, const std::vector<std::uint32_t>& pixels, 
+    unsigned samples, unsigned pass, std::vector<vec3>& radiance, const std::vector<Subtree>* roots)
+{
+    auto eye = scene.camera ().eye;
+    auto n = samples;
+    std::vector<StreamPath> paths, next, path_scratch;
+    std::vector<StreamShadow> shadows, shadow_scratch;
+    for (auto k: pixels) {
+        for (auto s = k; s < k + n; ++s) {
+            StreamPath path = {eye, dvec4 (rays.dx [s], rays.dy [s], rays.dz [s], 0.0), vec3 (1.0f), 
+                Random (ray_seed (rays.x [s], rays.y [s], s - k, pass)), s, int (scene.bounces ())};
+            paths.push_back (path);
+        }
+    }
+
+    auto primary = true;
+    while (!paths.empty ()) {
+        sort_stream (paths, path_scratch, [] (const StreamPath& p) { 
+            return std::make_pair (dvec3 (p.origin), dvec3 (p.direction)); 
+        });
+        prefetch (paths.size (), [&] (std::size_t i) {
+            return std::make_pair (dvec3 (paths [i].origin), dvec3 (paths [i].direction));
+        });
+        shadows.clear ();
+        next.clear ();
+        for (auto& p: paths) {
+            if (p.bounces <= 0)
+                continue;
+            Incident ti;
+            auto hit = primary && g_first_hits
+                ? primary_hit (rays.x [p.ray] + rays.y [p.ray]*g_width, p.origin, p.direction, ti, roots)
+                : intersect (p.origin.xyz, p.direction.xyz, ti, primary ? roots : nullptr);
+            if (!hit)
+                continue;
+            auto local = shade_lights (p.origin, ti, p.rng, 
+                [&] (const dvec3& L, double tmax, const vec3& C, std::uint32_t light) {
+                    StreamShadow shadow = {dvec3 (ti.point), L, tmax, p.throughput*C, p.ray, ti.primitive, light};
+                    shadows.push_back (shadow);
+                });
+            radiance [p.ray] += p.throughput*local;
+            StreamPath bounce = {ti.point, dvec4 (0.0), vec3 (0.0f), p.rng, p.ray, p.bounces - 1};
+            vec3 weight;
+            if (next_bounce (p.direction, ti, p.bounces, p.throughput, bounce.rng, bounce.direction, weight, bounce.throughput))
+                next.push_back (bounce);
+        }
+        sort_stream (shadows, shadow_scratch, [] (const StreamShadow& s) { 
+            return std::make_pair (s.point, s.direction); 
+        });
+        prefetch (shadows.size (), [&] (std::size_t i) {
+            return std::make_pair (shadows [i].point, shadows [i].direction);
+        });
+        for (const auto& s: shadows) {
+            if (!occluded (s.point, s.primitive, s.light, s.direction, s.tmax))
+                radiance [s.ray] += s.radiance;
+        }
+        std::swap (paths, next);
+        primary = false;
+    }
+}
+
+vec3 i2t::Core::shade_hit (const dvec4& Ro, const dvec4& Rd, const Incident& ti, int bounces, const vec3& throughput, Random& rng) {
+    typedef SceneData::Material Material;
+    switch (ti.material.shading) {
+    case Material::EMISSIVE: 
+        return shade<Material::EMISSIVE> (Ro, Rd, ti, bounces, throughput, rng);
+    case Material::DIFFUSE: 
+        return shade<Material::DIFFUSE> (Ro, Rd, ti, bounces, throughput, rng);
+    case Material::SPECULAR: 
+        return shade<Material::SPECULAR> (Ro, Rd, ti, bounces, throughput, rng);
+    default: 
+        return shade<Material::PHONG> (Ro, Rd, ti, bounces, throughput, rng);
+    }
+}
+
+static bool inside (const std::vector<Region>& regions, int x, int y) {
+    for (const auto& r: regions) {
+        if (x >= int (r.origin.x) && x < int (r.origin.x + r.size.x) &&
+            y >= int (r.origin.y) && y < int (r.origin.y + r.size.y))
+            return true;
+    }
+    return false;
+}
+
+std::vector<i2t::Core::Tile> i2t::Core::make_tiles (const std::vector<Region>& regions) const {
+    auto width  = int (scene.camera ().size.x);
+    auto height = int (scene.camera ().size.y);
+    auto tiles_x = (width + int (TILE_SIZE) - 1)/int (TILE_SIZE);
+    auto tiles_y = (height + int (TILE_SIZE) - 1)/int (TILE_SIZE);
+
+    std::vector<Tile> tiles;
+    tiles.reserve (tiles_x*tiles_y);
+    for (auto ty = 0; ty < tiles_y; ++ty)
+    for (auto tx = 0; tx < tiles_x; ++tx) {
+        Tile tile;
+        tile.index = unsigned (tx + ty*tiles_x);
+        tile.x0 = tx*int (TILE_SIZE);
+        tile.y0 = ty*int (TILE_SIZE);
+        tile.x1 = std::min (tile.x0 + int (TILE_SIZE), width);
+        tile.y1 = std::min (tile.y0 + int (TILE_SIZE), height);
+        tile.masked = false;
+        if (!regions.empty ()) {
+            auto x0 = tile.x1, y0 = tile.y1, x1 = tile.x0, y1 = tile.y0;
+            auto overlaps = 0;
+            for (const auto& r: regions) {
+                auto rx0 = std::max (tile.x0, int (r.origin.x));
+                auto ry0 = std::max (tile.y0, int (r.origin.y));
+                auto rx1 = std::min (tile.x1, int (r.origin.x + r.size.x));
+                auto ry1 = std::min (tile.y1, int (r.origin.y + r.size.y));
+                if (rx0 >= rx1 || ry0 >= ry1)
+                    continue;
+                x0 = std::min (x0, rx0); y0 = std::min (y0, ry0);
+                x1 = std::max (x1, rx1); y1 = std::max (y1, ry1);
+                ++overlaps;
+            }
+            if (!overlaps)
+                continue;
+            tile.x0 = x0; tile.y0 = y0;
+            tile.x1 = x1; tile.y1 = y1;
+            tile.masked = overlaps > 1;
+        }
+        tile.samples = 0u;
+        for (auto y = tile.y0; y < tile.y1; ++y)
+        for (auto x = tile.x0; x < tile.x1; ++x)
+            tile.samples += !tile.masked || inside (regions, x, y);
+        tiles.push_back (tile);
+    }
+    return tiles;
+}
+
+/* Options that change pixel values, as opposed to how fast they come. */
+std::uint64_t i2t::Core::hash () const {
+    auto h = hash_value (options.light_cutoff, scene.hash ());
+    h = hash_value (options.light_samples, h);
+    h = hash_value (options.shadow_cache_cell, h);
+    h = hash_value (options.throughput_cutoff, h);
+    h = hash_value (options.roulette_depth, h);
+    /* Without jitter the camera traces one ray a pixel whatever
+       pixel_samples says, so only the count it uses goes in. */
+    h = hash_value (options.jitter == Jitter::none ? 1u : std::max (options.pixel_samples, 1u), h);
+    return hash_value (options.jitter, h);
+}
+
+std::uint64_t i2t::Core::render_hash (const RenderControl& control) const {
+    auto h = hash_value (control.pass, hash ());
+    h = hash_value (control.pixels, h);
+    for (const auto& r: control.regions) {
+        h = hash_value (r.origin, h);
+        h = hash_value (r.size, h);
+    }
+    return h;
+}
+
+bool i2t::Core::resumable (const RenderControl& control) const {
+    Checkpoint checkpoint;
+    return resumable (control, checkpoint);
+}
+
+bool i2t::Core::resumable (const RenderControl& control, Checkpoint& checkpoint) const {
+    auto grid = ((g_width + TILE_SIZE - 1)/TILE_SIZE)*((g_height + TILE_SIZE - 1)/TILE_SIZE);
+    return !control.checkpoint.empty () && checkpoint.load (control.checkpoint) 
+        && checkpoint.hash == render_hash (control) && checkpoint.size == uvec2 (g_width, g_height) 
+        && checkpoint.tile_size == TILE_SIZE && checkpoint.done.size () == grid;
+}
+
+i2t::RenderProgress i2t::Core::render (const RenderControl& control) {
+    typedef std::chrono::steady_clock clock;
+
+    if (!g_moved.empty ())
+        refit_bvh ();
 
     auto width  = int (scene.camera ().size.x);
     auto height = int (scene.camera ().size.y);
-    auto fov    = 0.5*radians (scene.camera ().fov); 
-    auto aspect = (1.0*width)/height;
+    Camera camera (scene.camera (), options.pixel_samples, options.jitter);
+    const auto& ro = camera.eye ();
+    auto n = camera.samples ();
+    auto lowest = control.pixels == RenderPixels::holes ? HOLE 
+        : control.pixels == RenderPixels::stale ? STALE : FRESH;
+
+    auto tiles = make_tiles (control.regions);
+    auto ntiles = int (tiles.size ());
+    auto grid = ((width + TILE_SIZE - 1)/TILE_SIZE)*((height + TILE_SIZE - 1)/TILE_SIZE);
+
+    /* Pixels of restored tiles are marked as the render would have left
+       them, so they aren't traced again or skipped when reprojecting. */
+    Checkpoint checkpoint;
+    if (resumable (control, checkpoint)) {
+        std::copy (checkpoint.samples.begin (), checkpoint.samples.end (), g_samples.get ());
+        for (const auto& tile: tiles) {
+            if (!checkpoint.done [tile.index])
+                continue;
+            for (auto y = tile.y0; y < tile.y1; ++y)
+            for (auto x = tile.x0; x < tile.x1; ++x) {
+                auto& state = g_pixel_state [x + y*g_width];
+                if ((!tile.masked || inside (control.regions, x, y)) && state >= lowest)
+                    state = FRESH;
+            }
+        }
+    }
+    else if (!control.checkpoint.empty ()) {
+        checkpoint.hash = render_hash (control);
+        checkpoint.size = uvec2 (g_width, g_height);
+        checkpoint.tile_size = TILE_SIZE;
+        checkpoint.done.assign (grid, 0u);
+        checkpoint.samples.assign (g_samples.get (), g_samples.get () + g_width*g_height);
+    }
+    else
+        checkpoint.done.assign (grid, 0u);
+
+    std::unique_ptr<std::atomic<std::uint8_t> []> finished (new std::atomic<std::uint8_t> [grid]);
+    for (auto i = 0u; i < grid; ++i)
+        finished [i] = checkpoint.done [i];
+
+    /* The writer only reads tiles already flagged as finished, which no 
+       render thread touches again, so render threads never wait on it. */
+    std::mutex writer_mutex;
+    std::condition_variable writer_wake;
+    auto rendering = true;
+    std::thread writer;
+    if (!control.checkpoint.empty ()) {
+        writer = std::thread ([&] () {
+            auto flush = [&] () {
+                for (const auto& tile: tiles) {
+                    if (!finished [tile.index].load (std::memory_order_acquire) || checkpoint.done [tile.index])
+                        continue;
+                    for (auto y = tile.y0; y < tile.y1; ++y)
+                    for (auto x = tile.x0; x < tile.x1; ++x)
+                        checkpoint.samples [x + y*g_width] = g_samples [x + y*g_width];
+                    checkpoint.done [tile.index] = 1u;
+                }
+                checkpoint.save (control.checkpoint);
+            };
+            std::unique_lock<std::mutex> lock (writer_mutex);
+            while (!writer_wake.wait_for (lock, control.checkpoint_interval, [&] () { return !rendering; }))
+                flush ();
+            flush ();
+        });
+    }
+
+    auto deadline = clock::now () + control.time_budget;
+    std::atomic<int> status {int (RenderStatus::complete)};
+    std::atomic<std::size_t> tiles_done {0u};
+    std::atomic<std::size_t> samples {0u};
+
+    #pragma omp parallel for schedule (dynamic, 1)
+    for (auto i = 0; i < ntiles; ++i) {
+        const auto& tile = tiles [i];
+        if (finished [tile.index]) {
+            ++tiles_done;
+            continue;
+        }
+        if (status != int (RenderStatus::complete))
+            continue;
+
+        auto count = tile.samples;
+
+        if (control.cancel && control.cancel->cancelled ()) {
+            status = int (RenderStatus::cancelled);
+            continue;
+        }
+        if (control.time_budget.count () && clock::now () >= deadline) {
+            status = int (RenderStatus::out_of_time);
+            continue;
+        }
+        if (control.sample_budget && samples.fetch_add (count) + count > control.sample_budget) {
+            samples -= count;
+            status = int (RenderStatus::out_of_samples);
+            continue;
+        }
+        if (!control.sample_budget)
+            samples += count;
 
-    auto halfw  = 0.5*width;
-    auto halfh  = 0.5*height;
+        /* Triangles missed for want of their block would leave holes, so
+           a tile traced while a read failed isn't kept. */
+        auto failures = g_geometry.failures ();
+        RayBatch rays;
+        camera.generate (tile.x0, tile.y0, tile.x1, tile.y1, control.pass, rays);
+        std::vector<std::uint32_t> pixels;
+        for (auto k = 0u; k < rays.size (); k += n) {
+            auto cx = rays.x [k];
+            auto cy = rays.y [k];
+            if (tile.masked && !inside (control.regions, cx, cy))
+                continue;
+            if (g_pixel_state [cx + cy*g_width] >= lowest)
+                pixels.push_back (k);
+        }
 
-    auto tanfx  = (std::tan (fov)/halfw)*aspect;
-    auto tanfy  = (std::tan (fov)/halfh);
+        std::vector<Subtree> culled;
+        const std::vector<Subtree>* roots = nullptr;
+        if (options.cull_tiles && g_grid.empty () && !pixels.empty ()) {
+            cull (camera.frustum (tile.x0, tile.y0, tile.x1, tile.y1), culled);
+            roots = &culled;
+        }
 
-    auto ro = scene.camera ().eye;
+        std::vector<vec3> radiance (rays.size (), vec3 (0.0f));
+        if (options.stream)
+            render_stream (rays, pixels, n, control.pass, radiance, roots);
+        else {
+            prefetch (pixels.size ()*n, [&] (std::size_t i) {
+                auto s = pixels [i/n] + i%n;
+                return std::make_pair (dvec3 (ro), dvec3 (rays.dx [s], rays.dy [s], rays.dz [s]));
+            });
+            for (auto k: pixels) {
+                global_x = rays.x [k];
+                global_y = rays.y [k];
+                for (auto s = k; s < k + n; ++s) {
+                    Random rng (ray_seed (rays.x [s], rays.y [s], s - k, control.pass));
+                    auto rd = dvec4 (rays.dx [s], rays.dy [s], rays.dz [s], 0.0);
+                    radiance [s] = render_primary (rays.x [s] + rays.y [s]*g_width, ro, rd, rng, roots);
+                }
+            }
+        }
 
-    auto w = normalize (dvec3 (ro - scene.camera ().center));
-    auto u = normalize (cross (dvec3 (scene.camera ().up), w));
-    auto v = normalize (cross (w, u));
+        if (g_geometry.failures () != failures) {
+            status = int (RenderStatus::geometry_unreadable);
+            continue;
+        }
+        for (auto k: pixels) {
+            auto sample = vec3 (0.0f);
+            for (auto s = k; s < k + n; ++s)
+                sample += radiance [s];
+            store_sample (rays.x [k], rays.y [k], sample/float (n), control.pass);
+            g_pixel_state [rays.x [k] + rays.y [k]*g_width] = FRESH;
+        }
+        finished [tile.index].store (1u, std::memory_order_release);
+        ++tiles_done;
+    }
 
-    #pragma omp parallel for
-    for (auto cy = 0; cy < height; ++cy)         
-    for (auto cx = 0; cx < width;  ++cx) {
-        auto alfa = +tanfx*(cx + 0.5 - halfw);
-        auto beta = -tanfy*(cy + 0.5 - halfh);
-        auto rd = dvec4 (normalize (alfa*u + beta*v - w), 0.0);        
-        global_x = cx;
-        global_y = cy;
-        store_sample (cx, cy, render_sample (ro, rd, scene.bounces ()));
+    if (writer.joinable ()) {
+        {
+            std::lock_guard<std::mutex> lock (writer_mutex);
+            rendering = false;
+        }
+        writer_wake.notify_one ();
+        writer.join ();
     }
+
+    RenderProgress progress;
+    progress.tiles_done = tiles_done;
+    progress.tiles_total = tiles.size ();
+    progress.samples = samples;
+    progress.status = progress.tiles_done == progress.tiles_total 
+        ? RenderStatus::complete : RenderStatus (int (status));
+    return progress;
 }
 
 i2t::Core& i2t::Core::snapshot (std::uint32_t type, void* buff, std::uint32_t w, std::uint32_t h) {
@@ -260,4 +1414,17 @@ i2t::Core& i2t::Core::snapshot (std::uint32_t type, void* buff, std::uint32_t w,
     return *this; 
 }
 
+void i2t::Core::read_samples (const Region& region, vec3* out) const {
+    for (auto y = 0u; y < region.size.y; ++y)
+    for (auto x = 0u; x < region.size.x; ++x) 
+        *out++ = g_samples [(region.origin.x + x) + (region.origin.y + y)*g_width];
+}
 
+void i2t::Core::write_samples (const Region& region, const vec3* in) {
+    for (auto y = 0u; y < region.size.y; ++y)
+    for (auto x = 0u; x < region.size.x; ++x) {
+        auto i = (region.origin.x + x) + (region.origin.y + y)*g_width;
+        g_samples [i] = *in++;
+        g_pixel_state [i] = FRESH;
+    }
+}
@@ -3,21 +3,168 @@
 
 #include "Parser.h"
 #include "Common.h"
+#include "Lights.h"
+#include "ShadowCache.h"
+#include "Camera.h"
+#include "Bvh.h"
+#include "Grid.h"
+#include "GeometryStore.h"
+#include "SphereLeaves.h"
 #include <memory>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <string>
 
 namespace i2t {
 
+    struct Checkpoint;
+
+    struct CancelToken {
+        void cancel () { $cancelled = true; }
+        void reset () { $cancelled = false; }
+        bool cancelled () const { return $cancelled; }
+    private:
+        std::atomic<bool> $cancelled {false};
+    };
+
+    enum class RenderStatus {
+        complete,
+        cancelled,
+        out_of_time,
+        out_of_samples,
+        geometry_unreadable
+    };
+
+    struct Region {
+        uvec2 origin;
+        uvec2 size;
+    };
+
+    /* Which pixels a render traces. Holes are pixels without a sample for
+       the current camera. Stale adds those whose sample was reprojected 
+       from an earlier camera or predates a light or material edit. */
+    enum class RenderPixels {
+        all,
+        stale,
+        holes
+    };
+
+    /* Limits checked before each tile is started, zero means unlimited. 
+       With regions set only pixels inside them are traced, the rest of 
+       the frame keeps the samples of earlier renders. With a checkpoint
+       path finished tiles are saved there in the background every 
+       interval, and a matching checkpoint found there on start is resumed. 
+       Pass 0 overwrites the frame, later passes are averaged into it. */
+    struct RenderControl {
+        const CancelToken* cancel = nullptr;
+        std::chrono::milliseconds time_budget {0};
+        std::size_t sample_budget = 0u;
+        std::vector<Region> regions;
+        std::string checkpoint;
+        std::chrono::seconds checkpoint_interval {60};
+        unsigned pass = 0u;
+        RenderPixels pixels = RenderPixels::all;
+    };
+
+    struct RenderProgress {
+        RenderStatus status;
+        std::size_t tiles_done;
+        std::size_t tiles_total;
+        std::size_t samples;
+
+        double fraction () const { 
+            return tiles_total ? double (tiles_done)/tiles_total : 1.0; 
+        }
+    };
+
+    /* Per scene settings, fixed when the Core is built. Lights whose 
+       unshadowed contribution at a point is below light_cutoff are skipped
+       there, without tracing their shadow ray. With light_samples set, 
+       point lights aren't all evaluated: that many are picked per shading
+       point from a light hierarchy and weighted by their probability, and
+       the noise is averaged out over progressive passes. A nonzero 
+       shadow_cache_cell reuses shadow ray results between points on the 
+       same primitive that fall in the same cell of that size. With gbuffer
+       set, the first hit of every pixel is kept, so renders after light or
+       material edits skip primary visibility. Reflection paths end once
+       the product of specular terms along them drops below 
+       throughput_cutoff. With roulette_depth set, paths that deep also go
+       on only with probability equal to that product, and are weighted
+       up when they do, so deep bounce limits stay unbiased. Pixels are
+       the mean of pixel_samples rays placed by the jitter pattern; the 
+       G-buffer is only kept for one unjittered ray per pixel. With stream
+       set, a tile's rays are traced a bounce at a time, each bounce and 
+       its shadow rays sorted so similar rays go one after another. 
+       cull_tiles has each tile's primary rays start from the subtrees of
+       the hierarchy inside the tile's frustum, see cull (). accelerator 
+       may trace through a Grid instead of a hierarchy, the bvh options 
+       then go unused, see Accelerator. sphere_leaves tests the round 
+       spheres of a leaf together, see SphereLeaves. bvh_quality trades the 
+       hierarchy's build time against trace speed, see BvhQuality, and 
+       bvh_duplication caps the extra references spatial splits may add.
+       When geometry moves, a subtree is rebuilt once its SAH cost is
+       bvh_rebuild times what it was when built. bvh_width is 2 to trace
+       the binary hierarchy, or 4 or 8 to collapse it into a WideBvh.
+       bvh_compressed stores the wide nodes quantized instead, for meshes
+       whose hierarchy would otherwise not fit in memory; the binary
+       nodes are freed after the build, so moving geometry then means a
+       full rebuild. With bvh_cache naming a directory, built hierarchies
+       are saved there and loaded instead of built when the geometry and
+       settings match, see BvhCache. With geometry_file set, triangle
+       vertices and the hierarchy's primitive list are moved out of
+       memory into that scratch file and read back through a cache of
+       geometry_budget bytes, see GeometryStore; the nodes stay in memory,
+       and such a scene can't be transformed. A scene parsed with a spill
+       needs it set. */
+    struct CoreOptions {
+        float light_cutoff = 1.0f/4096.0f;
+        unsigned light_samples = 0u;
+        double shadow_cache_cell = 0.0;
+        bool gbuffer = false;
+        bool stream = false;
+        float throughput_cutoff = 1.0f/1024.0f;
+        unsigned roulette_depth = 0u;
+        unsigned pixel_samples = 1u;
+        Jitter jitter = Jitter::none;
+        bool cull_tiles = false;
+        Accelerator accelerator = Accelerator::bvh;
+        bool sphere_leaves = true;
+        BvhQuality bvh_quality = BvhQuality::fast;
+        double bvh_duplication = 0.25;
+        double bvh_rebuild = 1.5;
+        unsigned bvh_width = 4u;
+        bool bvh_compressed = false;
+        std::string bvh_cache;
+        std::string geometry_file;
+        std::size_t geometry_budget = std::size_t (256u) << 20u;
+    };
+
     struct Core {
+        /* Primitives are numbered triangles first, then spheres. */
         struct Incident {
             double t;
             dvec4 point;
             dvec4 normal;
             SceneData::Material material;
+            std::uint32_t primitive;
+        };
+
+        /* Where a traversal starts: a node, or for the wide hierarchies a
+           leaf's run of primitives when count is set, entered no nearer 
+           than t. */
+        struct Subtree {
+            std::uint32_t child;
+            std::uint32_t count;
+            double t;
         };
 
+        static const std::size_t MAX_SUBTREES = 64u;
+
         static const std::uint32_t RGBA32 = 0;
+        static const unsigned TILE_SIZE = 16u;
 
-        Core (const SceneData& scene);
+        Core (const SceneData& scene, const CoreOptions& options = CoreOptions ());
 
         bool sphere_intersect (
             const dvec3& gRo, const dvec3& gRd, 
@@ -41,18 +188,189 @@ namespace i2t {
             const dvec3& v2, double& tout);
         
 
-        bool intersect (const dvec3& ro, const dvec3& rd, Incident& in);
+        bool intersect (const dvec3& ro, const dvec3& rd, Incident& in, const std::vector<Subtree>* roots = nullptr);
         bool intersect (const dvec3& ro, const dvec3& rd, double tmax);
-        void store_sample (unsigned x, unsigned y, vec3 sample);
-        vec3 render_sample (const dvec4& ro, const dvec4& rd, int bounced);
 
-        void render ();
+        /* Calls leaf (first, count, tmax) for every leaf whose box the ray
+           enters before tmax, nearer child first, with its primitives at 
+           positions first to first + count of primitive_order (), or of
+           the geometry store's entries once it holds them. The grid
+           passes its cells' primitives one at a time. leaf may lower tmax,
+           or return true to stop. With roots, the traversal starts from 
+           those subtrees of the hierarchy instead of its root, see cull (). */
+        template <typename _Leaf>
+        void traverse (const dvec3& ro, const dvec3& rd, double tmax, _Leaf&& leaf, 
+            const std::vector<Subtree>* roots = nullptr) const;
+        template <typename _Leaf>
+        void traverse_grid (const dvec3& ro, const dvec3& rd, double tmax, _Leaf&& leaf) const;
+        template <typename _Wide, typename _Leaf>
+        void traverse_wide (const _Wide& bvh, const dvec3& ro, const dvec3& rd, double tmax, _Leaf&& leaf, 
+            const std::vector<Subtree>* roots = nullptr) const;
+        void store_sample (unsigned x, unsigned y, vec3 sample, unsigned pass = 0u);
+        vec3 render_sample (const dvec4& ro, const dvec4& rd, int bounced, const vec3& throughput, Random& rng);
+
+        RenderProgress render (const RenderControl& control = RenderControl ());
+
+        /* Hash of the scene, materials and options that change the pixel
+           values, which Cores rendering parts of one frame must agree on. */
+        std::uint64_t hash () const;
+
+        /* Whether render (control) would carry on from the checkpoint at
+           control's path rather than start the pass afresh. */
+        bool resumable (const RenderControl& control) const;
         Core& snapshot (std::uint32_t, void*, std::uint32_t, std::uint32_t);
 
+        void read_samples (const Region& region, vec3* out) const;
+        void write_samples (const Region& region, const vec3* in);
+
+        /* Scene edits between renders. Lights are indexed as in the scene, 
+           materials by id, with primitives sharing identical materials at 
+           load sharing an id. */
+        std::uint32_t material_count () const { return std::uint32_t (g_materials.size ()); }
+        std::uint32_t material_id (std::uint32_t primitive) const { return g_material_ids [primitive]; }
+        const SceneData::Material& material (std::uint32_t id) const { return g_materials [id]; }
+        void set_material (std::uint32_t id, const SceneData::Material& material);
+        void set_light (std::uint32_t index, const SceneData::Light& light);
+
+        /* Moves the camera, which must keep the frame size. With a G-buffer
+           the previous frame is reprojected into the new view through the
+           stored first hits, or for pixels not traced since the last move
+           the points their samples came from, and only the pixels nothing
+           lands on are left as holes. Without one the whole frame is left as holes. */
+        void set_camera (const SceneData::Camera& camera);
+
+        /* Animation between renders: moves a group of the scene's 
+           primitives by M, applied on top of the transforms they already
+           have. The hierarchy is refit to all moves since the last render
+           when the next one starts, rebuilding only the subtrees that got 
+           too much worse. Throws when triangles are out of core. */
+        void transform (std::uint32_t group, const dmat4& M);
+
     private:
+        struct Tile {
+            unsigned index;
+            int x0, y0, x1, y1;
+            bool masked;
+            std::size_t samples;
+        };
+
+        /* First hit of a pixel's primary ray, or one of the markers below
+           in place of the primitive. */
+        struct FirstHit {
+            dvec3 point;
+            dvec3 normal;
+            std::uint32_t primitive;
+        };
+
+        enum : std::uint8_t {
+            FRESH,
+            STALE,
+            HOLE
+        };
+
+        static const unsigned LIGHT_BATCH = 8u;
+        static const std::uint32_t UNTRACED = ~0u;
+        static const std::uint32_t MISSED = ~0u - 1u;
+
+        /* Primitive numbers in the order the leaves or cells refer to 
+           them, some listed more than once with spatial splits or a grid. */
+        const std::vector<std::uint32_t>& primitive_order () const {
+            return g_grid.empty () ? g_bvh.primitives () : g_grid.primitives ();
+        }
+
+        void build_lights ();
+        void collapse_bvh ();
+        void refit_bvh ();
+        void mark_stale ();
+        vec3 render_primary (std::size_t pixel, const dvec4& ro, const dvec4& rd, Random& rng, 
+            const std::vector<Subtree>* roots);
+        bool primary_hit (std::size_t pixel, const dvec4& ro, const dvec4& rd, Incident& ti, 
+            const std::vector<Subtree>* roots);
+
+        /* Subtrees holding everything a tile's primary rays can hit, at 
+           most MAX_SUBTREES of them, farthest first. Empty when nothing is
+           in view, and left empty with a grid. */
+        void cull (const Frustum& frustum, std::vector<Subtree>& out) const;
+        std::uint64_t ray_seed (int x, int y, unsigned sample, unsigned pass) const;
+        vec3 shade_hit (const dvec4& ro, const dvec4& rd, const Incident& ti, int bounces, const vec3& throughput, Random& rng);
+
+        std::vector<Tile> make_tiles (const std::vector<Region>& regions) const;
+        std::uint64_t render_hash (const RenderControl& control) const;
+        bool resumable (const RenderControl& control, Checkpoint& checkpoint) const;
+
+        /* Specialized per material class, so terms that are zero for the
+           whole class cost nothing. */
+        template <unsigned _Shading>
+        vec3 shade (const dvec4& ro, const dvec4& rd, const Incident& ti, int bounces, const vec3& throughput, Random& rng);
+        template <typename _Visit>
+        vec3 shade_lights (const dvec4& ro, const Incident& ti, Random& rng, _Visit&& visit);
+        template <unsigned _Shading, typename _Visit>
+        vec3 shade_local (const dvec4& ro, const Incident& ti, Random& rng, _Visit&& visit);
+        template <unsigned _Shading, typename _Visit>
+        void shade_directional (const Incident& ti, const dvec4& ED, _Visit&& visit);
+        template <unsigned _Shading, typename _Visit>
+        void shade_points (const std::uint32_t* index, const float* weight, std::size_t count,
+            const Incident& ti, const dvec4& ED, float cutoff, _Visit&& visit);
+        bool next_bounce (const dvec4& rd, const Incident& ti, int bounces, 
+            const vec3& throughput, Random& rng, dvec4& next_rd, vec3& weight, vec3& next);
+        bool occluded (const dvec3& point, std::uint32_t primitive, std::uint32_t light, const dvec3& L, double tmax);
+
+        /* Stream tracing state: a path waiting for its next ray, and a 
+           shadow ray with the radiance it carries if unblocked. Both refer
+           to their primary ray by its index in the tile's batch. */
+        struct StreamPath {
+            dvec4 origin;
+            dvec4 direction;
+            vec3 throughput;
+            Random rng;
+            std::uint32_t ray;
+            int bounces;
+        };
+
+        struct StreamShadow {
+            dvec3 point;
+            dvec3 direction;
+            double tmax;
+            vec3 radiance;
+            std::uint32_t ray;
+            std::uint32_t primitive;
+            std::uint32_t light;
+        };
+
+        void render_stream (const RayBatch& rays, const std::vector<std::uint32_t>& pixels, 
+            unsigned samples, unsigned pass, std::vector<vec3>& radiance, const std::vector<Subtree>* roots);
+
+        /* Has the geometry store read ahead what count rays will reach. */
+        template <typename _Ray>
+        void prefetch (std::size_t count, _Ray&& ray);
+
         std::size_t g_width, g_height;
         std::unique_ptr<vec3 []> g_samples;
         SceneData scene;
+        CoreOptions options;
+        LightGrid g_lights;
+        LightTree g_light_tree;
+        DirectionalLights g_directional;
+        PointLights g_points;
+        ShadowCache g_shadows;
+        Grid g_grid;
+        Bvh g_bvh;
+        WideBvh<4u> g_bvh4;
+        WideBvh<8u> g_bvh8;
+        QuantizedBvh<4u> g_qbvh4;
+        QuantizedBvh<8u> g_qbvh8;
+        SphereLeaves g_spheres;
+        GeometryStore g_geometry;
+        std::vector<std::uint32_t> g_moved;
+        std::vector<SceneData::Material> g_materials;
+        std::vector<std::uint32_t> g_material_ids;
+        std::unique_ptr<FirstHit []> g_first_hits;
+
+        /* Where the sample now at each pixel was seen, kept for those that
+           were reprojected there so the next camera move can carry them
+           on again. UNTRACED for the others. */
+        std::unique_ptr<FirstHit []> g_reprojected;
+        std::unique_ptr<std::uint8_t []> g_pixel_state;
 
         int global_x, global_y;
         
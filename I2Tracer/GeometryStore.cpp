@@ -0,0 +1,211 @@
+#include "GeometryStore.h"
+#include <algorithm>
+
+namespace {
+
+    static int seek (std::FILE* file, std::uint64_t offset) {
+#ifdef _WIN32
+        return _fseeki64 (file, std::int64_t (offset), SEEK_SET);
+#else
+        return fseeko (file, off_t (offset), SEEK_SET);
+#endif
+    }
+
+}
+
+i2t::GeometryStore::~GeometryStore () {
+    close ();
+}
+
+void i2t::GeometryStore::close () {
+    if (!$file)
+        return;
+    {
+        std::lock_guard<std::mutex> lock ($mutex);
+        $stop = true;
+    }
+    $wake.notify_all ();
+    $worker.join ();
+    std::fclose ($file);
+    std::remove ($path.c_str ());
+    $file = nullptr;
+}
+
+/* Released triangles come from the spill. A window's wanted triangles
+   are sorted by number and read a spill chunk at a time, skipping the
+   chunks none of them lie in. */
+bool i2t::GeometryStore::create (const std::string& path, const SceneData& scene,
+    const std::vector<std::uint32_t>& order, std::size_t budget)
+{
+    static const std::size_t CHUNK = 4096u;
+    close ();
+    auto out = std::fopen (path.c_str (), "wb");
+    if (!out)
+        return false;
+    const auto triangles = std::uint32_t (scene.triangle_count ());
+    const auto released = std::uint32_t (triangles - scene.triangles ().size ());
+    const auto window = std::max<std::size_t> (budget/(BLOCK*sizeof (Entry)), 1u)*BLOCK;
+    std::vector<Entry> buffer;
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> wanted;
+    std::vector<dvec3> spilled;
+    auto written = true;
+    for (std::size_t w = 0u; w < order.size () && written; w += window) {
+        buffer.assign (std::min (window, order.size () - w), Entry {dvec3 (0.0), dvec3 (0.0), dvec3 (0.0), 0u, 0u});
+        wanted.clear ();
+        for (auto k = 0u; k < buffer.size (); ++k) {
+            auto id = order [w + k];
+            buffer [k].primitive = id;
+            if (id < released)
+                wanted.push_back ({id, k});
+            else if (id < triangles) {
+                const auto& t = scene.triangles () [id - released];
+                buffer [k].v0 = dvec3 (t.v0);
+                buffer [k].v1 = dvec3 (t.v1);
+                buffer [k].v2 = dvec3 (t.v2);
+            }
+        }
+        std::sort (wanted.begin (), wanted.end ());
+        for (auto i = 0u; i < wanted.size () && written;) {
+            auto first = wanted [i].first/CHUNK*CHUNK;
+            auto count = std::min<std::size_t> (CHUNK, released - first);
+            spilled.resize (3u*count);
+            written = scene.read_spill (first, count, spilled.data ());
+            for (; written && i < wanted.size () && wanted [i].first < first + count; ++i) {
+                auto& e = buffer [wanted [i].second];
+                const auto* v = &spilled [3u*(wanted [i].first - first)];
+                e.v0 = v [0];
+                e.v1 = v [1];
+                e.v2 = v [2];
+            }
+        }
+        written = written && std::fwrite (buffer.data (), sizeof (Entry), buffer.size (), out) == buffer.size ();
+    }
+    written = std::fclose (out) == 0 && written;
+    $file = written ? std::fopen (path.c_str (), "rb") : nullptr;
+    if (!$file) {
+        std::remove (path.c_str ());
+        return false;
+    }
+
+    $path = path;
+    $count = std::uint32_t (order.size ());
+    auto blocks = ($count + BLOCK - 1u)/BLOCK;
+    $blocks.assign (blocks, Block ());
+    $state.reset (new std::atomic<std::uint8_t> [blocks]);
+    $used.reset (new std::atomic<std::uint8_t> [blocks]);
+    for (auto i = 0u; i < blocks; ++i)
+        $state [i] = $used [i] = 0u;
+    $capacity = std::max<std::size_t> (budget/(BLOCK*sizeof (Entry)), 2u);
+    $resident.clear ();
+    $hand = 0u;
+    $queue.clear ();
+    $stop = false;
+    $failures = 0u;
+    $worker = std::thread ([this] () {
+        std::unique_lock<std::mutex> lock ($mutex);
+        while (true) {
+            $wake.wait (lock, [this] () { return $stop || !$queue.empty (); });
+            if ($stop)
+                return;
+            auto index = $queue.front ();
+            $queue.pop_front ();
+            if ($state [index] == QUEUED) {
+                $state [index] = LOADING;
+                load (index, lock);
+            }
+        }
+    });
+    return true;
+}
+
+/* A block another thread is reading is waited for rather than read
+   twice. One that still can't be read after RETRIES tries is counted in
+   failures () and handed out with its entries MISSING, without keeping
+   it, so the next use reads it again. */
+i2t::GeometryStore::Block i2t::GeometryStore::fetch (std::uint32_t index) {
+    static const unsigned RETRIES = 3u;
+    auto block = std::atomic_load (&$blocks [index]);
+    if (block) {
+        $used [index].store (1u, std::memory_order_relaxed);
+        return block;
+    }
+    std::unique_lock<std::mutex> lock ($mutex);
+    for (auto tries = 0u; tries < RETRIES; ++tries) {
+        $loaded.wait (lock, [&] () { return $state [index] != LOADING; });
+        block = std::atomic_load (&$blocks [index]);
+        if (block)
+            return block;
+        $state [index] = LOADING;
+        block = load (index, lock);
+        if (block)
+            return block;
+    }
+    ++$failures;
+    auto count = std::size_t (std::min<std::uint64_t> (BLOCK, $count - std::uint64_t (index)*BLOCK));
+    return std::make_shared<std::vector<Entry>> (count, Entry {dvec3 (0.0), dvec3 (0.0), dvec3 (0.0), MISSING, 0u});
+}
+
+/* Called with lock held on the mutex and the block marked LOADING. The
+   read itself is done without it, under $reading alone, so readers
+   finding their blocks resident or queueing read ahead don't wait on
+   the disk. On success the clock hand skips blocks used since it last
+   passed, clearing their mark, and evicts the first one that isn't. */
+i2t::GeometryStore::Block i2t::GeometryStore::load (std::uint32_t index, std::unique_lock<std::mutex>& lock) {
+    auto first = std::uint64_t (index)*BLOCK;
+    auto count = std::size_t (std::min<std::uint64_t> (BLOCK, $count - first));
+    auto block = std::make_shared<std::vector<Entry>> (count);
+    lock.unlock ();
+    auto read = false;
+    {
+        std::lock_guard<std::mutex> reading ($reading);
+        read = seek ($file, first*sizeof (Entry)) == 0
+            && std::fread (block->data (), sizeof (Entry), count, $file) == count;
+    }
+    lock.lock ();
+    if (!read) {
+        $state [index] = ABSENT;
+        $loaded.notify_all ();
+        return Block ();
+    }
+
+    if ($resident.size () < $capacity)
+        $resident.push_back (index);
+    else {
+        while ($used [$resident [$hand]].exchange (0u, std::memory_order_relaxed))
+            $hand = ($hand + 1u)%$resident.size ();
+        auto victim = $resident [$hand];
+        std::atomic_store (&$blocks [victim], Block ());
+        $state [victim] = ABSENT;
+        $resident [$hand] = index;
+        $hand = ($hand + 1u)%$resident.size ();
+    }
+    Block loaded = block;
+    std::atomic_store (&$blocks [index], loaded);
+    $state [index] = RESIDENT;
+    $used [index].store (1u, std::memory_order_relaxed);
+    $loaded.notify_all ();
+    return loaded;
+}
+
+void i2t::GeometryStore::prefetch (std::uint32_t first, std::uint32_t count) {
+    if (!count || first >= $count)
+        return;
+    auto last = std::min (first + count, $count) - 1u;
+    for (auto index = first/BLOCK; index <= last/BLOCK; ++index)
+        queue (index);
+}
+
+/* Only as far ahead as half the cache, so read ahead never evicts what
+   it read itself before it's used. */
+void i2t::GeometryStore::queue (std::uint32_t index) {
+    if ($state [index].load (std::memory_order_relaxed) != ABSENT)
+        return;
+    {
+        std::lock_guard<std::mutex> lock ($mutex);
+        if ($state [index] != ABSENT || $queue.size () >= $capacity/2u)
+            return;
+        $state [index] = QUEUED;
+        $queue.push_back (index);
+    }
+    $wake.notify_one ();
+}
@@ -0,0 +1,113 @@
+#ifndef __GEOMETRYSTORE_H__
+#define __GEOMETRYSTORE_H__
+
+#include "Parser.h"
+#include "Common.h"
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <vector>
+#include <string>
+#include <cstdio>
+
+namespace i2t {
+
+    /* A hierarchy's primitive list and the vertices of its triangles,
+       kept in a scratch file instead of memory. Entry i stands for
+       position i of the list, so the entries are laid out in the order
+       the leaves refer to them, in blocks of BLOCK that are runs of
+       neighbouring subtrees; spheres are stored by number only. Blocks
+       are read on first use and at most budget bytes of them stay
+       resident, the least recently used going first (clock). Readers hold
+       the block they're in, so eviction never frees one under them.
+       prefetch () has a background thread read a run of entries ahead of
+       its use. A block that can't be read is tried again, and failing
+       that comes back with its entries MISSING for that use only, counted
+       in failures () so the render can be given up. */
+    struct GeometryStore {
+        static const std::uint32_t BLOCK = 1024u;
+        static const std::uint32_t MISSING = ~0u;
+
+        struct Entry {
+            dvec3 v0;
+            dvec3 v1;
+            dvec3 v2;
+            std::uint32_t primitive;
+            std::uint32_t padding;
+        };
+
+        typedef std::shared_ptr<const std::vector<Entry>> Block;
+
+        /* A reader's hold on the block it last used, one per traversal. */
+        struct Cursor {
+            Block block;
+            std::uint32_t index = ~0u;
+        };
+
+        GeometryStore () = default;
+        GeometryStore (const GeometryStore&) = delete;
+        GeometryStore& operator = (const GeometryStore&) = delete;
+        ~GeometryStore ();
+
+        /* order is the primitive list to store. Spilled triangles are
+           gathered from the scene's spill a window of budget bytes at a
+           time, with one forward pass over the spill per window. */
+        bool create (const std::string& path, const SceneData& scene,
+            const std::vector<std::uint32_t>& order, std::size_t budget);
+        bool enabled () const { return $file != nullptr; }
+        std::uint32_t size () const { return $count; }
+
+        const Entry& entry (std::uint32_t position, Cursor& cursor) {
+            if (cursor.index != position/BLOCK) {
+                cursor.index = position/BLOCK;
+                cursor.block = fetch (cursor.index);
+            }
+            return (*cursor.block) [position%BLOCK];
+        }
+
+        /* Queues the blocks holding count entries from first. */
+        void prefetch (std::uint32_t first, std::uint32_t count);
+
+        std::size_t failures () const { return $failures; }
+
+    private:
+        enum : std::uint8_t {
+            ABSENT,
+            QUEUED,
+            LOADING,
+            RESIDENT
+        };
+
+        Block fetch (std::uint32_t index);
+        Block load (std::uint32_t index, std::unique_lock<std::mutex>& lock);
+        void queue (std::uint32_t index);
+        void close ();
+
+        std::FILE* $file = nullptr;
+        std::string $path;
+        std::uint32_t $count = 0u;
+        std::vector<Block> $blocks;
+        std::unique_ptr<std::atomic<std::uint8_t> []> $state;
+        std::unique_ptr<std::atomic<std::uint8_t> []> $used;
+        std::vector<std::uint32_t> $resident;
+        std::size_t $capacity = 0u;
+        std::size_t $hand = 0u;
+
+        /* Guards block states, eviction and the prefetch queue; $reading
+           guards the file. */
+        std::mutex $mutex;
+        std::mutex $reading;
+        std::condition_variable $wake;
+        std::condition_variable $loaded;
+        std::atomic<std::size_t> $failures {0u};
+        std::deque<std::uint32_t> $queue;
+        std::thread $worker;
+        bool $stop = false;
+    };
+
+}
+
+#endif
@@ -0,0 +1,104 @@
+#include "Grid.h"
+#include <cmath>
+#include <algorithm>
+#include <limits>
+
+/* Bounds and resolution, about DENSITY cells per primitive. Flat
+   bounds get a little depth, so the cell count comes out the same for a
+   plane of primitives as for a slab of them. */
+void i2t::Grid::frame (const std::vector<Bounds>& bounds) {
+    $lo = dvec3 (std::numeric_limits<double>::max ());
+    $hi = -$lo;
+    for (const auto& b: bounds) {
+        $lo = min ($lo, b.lo);
+        $hi = max ($hi, b.hi);
+    }
+    auto extent = $hi - $lo;
+    auto e = max (extent, dvec3 (max (extent.x, max (extent.y, extent.z))*1e-3 + 1e-9));
+    auto k = std::cbrt (double (DENSITY)*double (bounds.size ())/(e.x*e.y*e.z));
+    $res = clamp (ivec3 (ceil (e*k)), ivec3 (1), ivec3 (MAX_RESOLUTION));
+    $cell = max (extent, dvec3 (1e-9))/dvec3 ($res);
+    $inv_cell = 1.0/$cell;
+}
+
+std::pair<i2t::ivec3, i2t::ivec3> i2t::Grid::range (const Bounds& box) const {
+    return std::make_pair (
+        clamp (ivec3 (floor ((box.lo - $lo)*$inv_cell)), ivec3 (0), $res - 1),
+        clamp (ivec3 (floor ((box.hi - $lo)*$inv_cell)), ivec3 (0), $res - 1));
+}
+
+/* The 10th and 90th percentile of the boxes' longest sides within a
+   factor of four, the 90th within two cells, and half the cells holding
+   something. Spread out sizes or large primitives send rays through many
+   cells listing the same few boxes, and clustered ones through runs of
+   empty cells, where a hierarchy adapts. */
+bool i2t::Grid::suits (const std::vector<Bounds>& bounds) {
+    static const std::size_t MIN_PRIMITIVES = 64u;
+    static const double MIN_OCCUPANCY = 0.5;
+    if (bounds.size () < MIN_PRIMITIVES)
+        return false;
+    std::vector<double> sides (bounds.size ());
+    for (auto i = 0u; i < bounds.size (); ++i) {
+        auto e = bounds [i].hi - bounds [i].lo;
+        sides [i] = max (e.x, max (e.y, e.z));
+    }
+    auto p10 = sides.begin () + sides.size ()/10u;
+    std::nth_element (sides.begin (), p10, sides.end ());
+    auto small = *p10;
+    auto p90 = sides.begin () + sides.size ()*9u/10u;
+    std::nth_element (sides.begin (), p90, sides.end ());
+    auto large = *p90;
+    Grid grid;
+    grid.frame (bounds);
+    if (large > 4.0*small || large > 2.0*max (grid.$cell.x, max (grid.$cell.y, grid.$cell.z)))
+        return false;
+
+    auto cells = std::size_t (grid.$res.x)*grid.$res.y*grid.$res.z;
+    std::vector<bool> occupied (cells, false);
+    auto count = std::size_t (0u);
+    for (const auto& b: bounds) {
+        auto r = grid.range (b);
+        for (auto z = r.first.z; z <= r.second.z; ++z)
+        for (auto y = r.first.y; y <= r.second.y; ++y)
+        for (auto x = r.first.x; x <= r.second.x; ++x) {
+            auto c = grid.index (ivec3 (x, y, z));
+            count += !occupied [c];
+            occupied [c] = true;
+        }
+    }
+    return double (count) >= MIN_OCCUPANCY*double (cells);
+}
+
+void i2t::Grid::build (const std::vector<Bounds>& bounds) {
+    $cells.clear ();
+    $primitives.clear ();
+    $res = ivec3 (0);
+    if (bounds.empty ())
+        return;
+    frame (bounds);
+
+    auto cells = std::size_t ($res.x)*$res.y*$res.z;
+    std::vector<std::uint32_t> counts (cells, 0u);
+    for (const auto& b: bounds) {
+        auto r = range (b);
+        for (auto z = r.first.z; z <= r.second.z; ++z)
+        for (auto y = r.first.y; y <= r.second.y; ++y)
+        for (auto x = r.first.x; x <= r.second.x; ++x)
+            ++counts [index (ivec3 (x, y, z))];
+    }
+
+    $cells.assign (cells + 1u, 0u);
+    for (auto c = 0u; c < cells; ++c)
+        $cells [c + 1] = $cells [c] + counts [c];
+    $primitives.resize ($cells [cells]);
+    std::fill (counts.begin (), counts.end (), 0u);
+    for (auto i = 0u; i < bounds.size (); ++i) {
+        auto r = range (bounds [i]);
+        for (auto z = r.first.z; z <= r.second.z; ++z)
+        for (auto y = r.first.y; y <= r.second.y; ++y)
+        for (auto x = r.first.x; x <= r.second.x; ++x) {
+            auto c = index (ivec3 (x, y, z));
+            $primitives [$cells [c] + counts [c]++] = i;
+        }
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef __GRID_H__
+#define __GRID_H__
+
+#include "Bvh.h"
+#include "Common.h"
+#include <vector>
+#include <utility>
+
+namespace i2t {
+
+    /* Which structure rays are traced through. automatic takes the grid
+       when Grid::suits () the primitives, a hierarchy otherwise. */
+    enum class Accelerator {
+        bvh,
+        grid,
+        automatic
+    };
+
+    /* Uniform grid over primitive bounds, about DENSITY cells per
+       primitive with cells as close to cubes as the bounds allow. Each
+       cell lists the primitives whose box overlaps it, in primitive order,
+       cells () holding where each cell's run of primitives () starts and
+       one more entry for the end. A primitive spanning several cells is
+       listed in all of them. Built serially in two passes over the
+       bounds, counting then filling, far quicker than any hierarchy. */
+    struct Grid {
+        static const unsigned DENSITY = 4u;
+        static const int MAX_RESOLUTION = 1024;
+
+        /* Primitives of much the same size, none large next to a cell, 
+           spread through most of their bounds: particles, lattices, 
+           foliage instances, point clouds. */
+        static bool suits (const std::vector<Bounds>& bounds);
+
+        void build (const std::vector<Bounds>& bounds);
+
+        bool empty () const { return $cells.empty (); }
+        const dvec3& lo () const { return $lo; }
+        const dvec3& hi () const { return $hi; }
+        const dvec3& cell_size () const { return $cell; }
+        const dvec3& inv_cell () const { return $inv_cell; }
+        const ivec3& resolution () const { return $res; }
+        const std::vector<std::uint32_t>& cells () const { return $cells; }
+        const std::vector<std::uint32_t>& primitives () const { return $primitives; }
+
+        std::uint32_t index (const ivec3& cell) const {
+            return std::uint32_t (cell.x + $res.x*(cell.y + $res.y*cell.z));
+        }
+
+    private:
+        void frame (const std::vector<Bounds>& bounds);
+        std::pair<ivec3, ivec3> range (const Bounds& box) const;
+
+        dvec3                       $lo;
+        dvec3                       $hi;
+        dvec3                       $cell;
+        dvec3                       $inv_cell;
+        ivec3                       $res;
+        std::vector<std::uint32_t>  $cells;
+        std::vector<std::uint32_t>  $primitives;
+    };
+
+}
+
+#endif
@@ -0,0 +1,228 @@
+#include "Lights.h"
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+double i2t::influence_radius (const SceneData::Light& light, float cutoff) {
+    static const auto infinity = std::numeric_limits<double>::infinity ();
+    if (light.position.w == 0.0 || cutoff <= 0.0f)
+        return infinity;
+    const auto& C = light.attenuation;
+    auto I = double (max (light.color.r, max (light.color.g, light.color.b)));
+    auto k = double (C [0]) - I/cutoff;
+    if (k >= 0.0)
+        return 0.0;
+    if (C [2] > 0.0f)
+        return (-C [1] + std::sqrt (double (C [1])*C [1] - 4.0*C [2]*k))/(2.0*C [2]);
+    if (C [1] > 0.0f)
+        return -k/C [1];
+    return infinity;
+}
+
+void i2t::DirectionalLights::push_back (const SceneData::Light& light) {
+    auto d = normalize (dvec3 (light.position));
+    x.push_back (d.x);
+    y.push_back (d.y);
+    z.push_back (d.z);
+    r.push_back (light.color.r);
+    g.push_back (light.color.g);
+    b.push_back (light.color.b);
+}
+
+void i2t::PointLights::push_back (const SceneData::Light& light) {
+    auto p = dvec3 (light.position)/light.position.w;
+    x.push_back (p.x);
+    y.push_back (p.y);
+    z.push_back (p.z);
+    r.push_back (light.color.r);
+    g.push_back (light.color.g);
+    b.push_back (light.color.b);
+    c0.push_back (light.attenuation [0]);
+    c1.push_back (light.attenuation [1]);
+    c2.push_back (light.attenuation [2]);
+}
+
+void i2t::LightGrid::build (const std::vector<SceneData::Light>& lights, float cutoff) {
+    static const auto MAX_RES = 64;
+    static const auto MAX_CELLS_PER_LIGHT = 4096;
+
+    $radius.resize (lights.size ());
+    $unbounded.clear ();
+    $offsets.assign (1u, 0u);
+    $indices.clear ();
+    $res = ivec3 (0);
+
+    std::vector<std::uint32_t> bounded;
+    auto lo = dvec3 (std::numeric_limits<double>::max ());
+    auto hi = -lo;
+    for (auto i = 0u; i < lights.size (); ++i) {
+        $radius [i] = influence_radius (lights [i], cutoff);
+        if (!std::isfinite ($radius [i])) {
+            $unbounded.push_back (i);
+            continue;
+        }
+        if ($radius [i] <= 0.0)
+            continue;
+        auto p = dvec3 (lights [i].position) / lights [i].position.w;
+        lo = min (lo, p - $radius [i]);
+        hi = max (hi, p + $radius [i]);
+        bounded.push_back (i);
+    }
+    if (bounded.empty ())
+        return;
+
+    /* Cells about the size of the median light radius, capped per axis. */
+    std::vector<double> radii;
+    for (auto i: bounded)
+        radii.push_back ($radius [i]);
+    std::nth_element (radii.begin (), radii.begin () + radii.size ()/2, radii.end ());
+    auto extent = hi - lo;
+    auto cell = max (radii [radii.size ()/2], max (extent.x, max (extent.y, extent.z))/MAX_RES);
+    $res = clamp (ivec3 (ceil (extent/cell)), ivec3 (1), ivec3 (MAX_RES));
+    $min = lo;
+    $inv_cell = dvec3 ($res)/max (extent, dvec3 (1e-9));
+
+    auto cells = std::size_t ($res.x)*$res.y*$res.z;
+    std::vector<std::pair<ivec3, ivec3>> ranges (lights.size ());
+    std::vector<std::uint32_t> counts (cells + 1u, 0u);
+    for (auto i: bounded) {
+        auto p = dvec3 (lights [i].position) / lights [i].position.w;
+        auto a = clamp (ivec3 (floor ((p - $radius [i] - $min)*$inv_cell)), ivec3 (0), $res - 1);
+        auto b = clamp (ivec3 (floor ((p + $radius [i] - $min)*$inv_cell)), ivec3 (0), $res - 1);
+        auto span = b - a + 1;
+        if (span.x*span.y*span.z > MAX_CELLS_PER_LIGHT) {
+            $unbounded.push_back (i);
+            continue;
+        }
+        ranges [i] = std::make_pair (a, b);
+        for (auto z = a.z; z <= b.z; ++z)
+        for (auto y = a.y; y <= b.y; ++y)
+        for (auto x = a.x; x <= b.x; ++x)
+            ++counts [x + $res.x*(y + $res.y*z)];
+    }
+    std::sort ($unbounded.begin (), $unbounded.end ());
+
+    $offsets.assign (cells + 1u, 0u);
+    for (auto c = 0u; c < cells; ++c)
+        $offsets [c + 1] = $offsets [c] + counts [c];
+    $indices.resize ($offsets [cells]);
+    std::fill (counts.begin (), counts.end (), 0u);
+    for (auto i: bounded) {
+        if (std::binary_search ($unbounded.begin (), $unbounded.end (), i))
+            continue;
+        auto a = ranges [i].first;
+        auto b = ranges [i].second;
+        for (auto z = a.z; z <= b.z; ++z)
+        for (auto y = a.y; y <= b.y; ++y)
+        for (auto x = a.x; x <= b.x; ++x) {
+            auto c = x + $res.x*(y + $res.y*z);
+            $indices [$offsets [c] + counts [c]++] = i;
+        }
+    }
+}
+
+i2t::LightGrid::Span i2t::LightGrid::unbounded () const {
+    return {$unbounded.data (), $unbounded.data () + $unbounded.size ()};
+}
+
+i2t::LightGrid::Span i2t::LightGrid::cell (const dvec3& p) const {
+    if ($res.x == 0)
+        return {nullptr, nullptr};
+    auto c = ivec3 (floor ((p - $min)*$inv_cell));
+    if (any (lessThan (c, ivec3 (0))) || any (greaterThanEqual (c, $res)))
+        return {nullptr, nullptr};
+    auto i = c.x + $res.x*(c.y + $res.y*c.z);
+    return {$indices.data () + $offsets [i], $indices.data () + $offsets [i + 1]};
+}
+
+void i2t::LightTree::build (const std::vector<SceneData::Light>& lights) {
+    $nodes.clear ();
+    std::vector<std::uint32_t> points;
+    for (auto i = 0u; i < lights.size (); ++i)
+        if (lights [i].position.w != 0.0)
+            points.push_back (i);
+    if (points.empty ())
+        return;
+    $nodes.reserve (2u*points.size ());
+    $nodes.resize (1u);
+    build (lights, 0u, points.data (), points.data () + points.size ());
+}
+
+void i2t::LightTree::build (const std::vector<SceneData::Light>& lights, std::uint32_t index, std::uint32_t* first, std::uint32_t* last) {
+    auto position = [&] (std::uint32_t i) {
+        return vec3 (dvec3 (lights [i].position)/lights [i].position.w);
+    };
+
+    Node node;
+    node.min = vec3 (std::numeric_limits<float>::max ());
+    node.max = -node.min;
+    node.attenuation = node.min;
+    node.intensity = 0.0f;
+    for (auto i = first; i != last; ++i) {
+        const auto& l = lights [*i];
+        node.min = min (node.min, position (*i));
+        node.max = max (node.max, position (*i));
+        node.attenuation = min (node.attenuation, l.attenuation);
+        node.intensity += l.color.r + l.color.g + l.color.b;
+    }
+
+    if (last - first == 1) {
+        node.child = 0u;
+        node.light = std::int32_t (*first);
+        $nodes [index] = node;
+        return;
+    }
+
+    auto extent = node.max - node.min;
+    auto axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    auto middle = first + (last - first)/2;
+    std::nth_element (first, middle, last, [&] (std::uint32_t a, std::uint32_t b) {
+        return position (a) [axis] < position (b) [axis];
+    });
+
+    node.child = std::uint32_t ($nodes.size ());
+    node.light = -1;
+    $nodes [index] = node;
+    $nodes.resize ($nodes.size () + 2u);
+    build (lights, node.child, first, middle);
+    build (lights, node.child + 1u, middle, last);
+}
+
+float i2t::LightTree::importance (const Node& node, const dvec3& p, const dvec3& n, bool oriented) const {
+    auto center = 0.5*(dvec3 (node.min) + dvec3 (node.max));
+    auto half = 0.5*(dvec3 (node.max) - dvec3 (node.min));
+    if (oriented && dot (n, center - p) + dot (abs (n), half) <= 0.0)
+        return 0.0f;
+    auto d = std::max (length (p - center), length (half));
+    const auto& C = node.attenuation;
+    auto c = std::max (C [0] + C [1]*d + C [2]*d*d, 1e-6);
+    return float (node.intensity/c);
+}
+
+bool i2t::LightTree::sample (const dvec3& p, const dvec3& n, bool oriented, double u, std::uint32_t& light, double& pdf) const {
+    if ($nodes.empty ())
+        return false;
+    pdf = 1.0;
+    const auto* node = &$nodes [0];
+    while (node->light < 0) {
+        const auto& l = $nodes [node->child];
+        const auto& r = $nodes [node->child + 1];
+        auto wl = double (importance (l, p, n, oriented));
+        auto wr = double (importance (r, p, n, oriented));
+        if (wl + wr <= 0.0)
+            return false;
+        auto pl = wl/(wl + wr);
+        if (u < pl) {
+            u = u/pl;
+            pdf *= pl;
+            node = &l;
+        }
+        else {
+            u = (u - pl)/(1.0 - pl);
+            pdf *= 1.0 - pl;
+            node = &r;
+        }
+    }
+    light = std::uint32_t (node->light);
+    return true;
+}
@@ -0,0 +1,99 @@
+#ifndef __LIGHTS_H__
+#define __LIGHTS_H__
+
+#include "Parser.h"
+#include "Common.h"
+#include <vector>
+
+namespace i2t {
+
+    /* Distance past which a point light of the given color and attenuation 
+       can't contribute more than cutoff, infinite without falloff. */
+    double influence_radius (const SceneData::Light& light, float cutoff);
+
+    /* Structure of arrays for each light type, so a batch of lights can 
+       be shaded in SIMD lanes. Directions are normalized, positions are 
+       divided through by w. */
+    struct DirectionalLights {
+        void push_back (const SceneData::Light& light);
+        std::size_t size () const { return x.size (); }
+
+        std::vector<double> x, y, z;
+        std::vector<float> r, g, b;
+    };
+
+    struct PointLights {
+        void push_back (const SceneData::Light& light);
+        std::size_t size () const { return x.size (); }
+
+        std::vector<double> x, y, z;
+        std::vector<float> r, g, b;
+        std::vector<float> c0, c1, c2;
+    };
+
+    /* Uniform grid over the influence spheres of attenuated point lights.
+       Lights without a finite radius (unattenuated, or so 
+       large they'd cover most of the grid) are kept in a separate list 
+       that applies everywhere. */
+    struct LightGrid {
+        struct Span {
+            const std::uint32_t* first;
+            const std::uint32_t* last;
+            const std::uint32_t* begin () const { return first; }
+            const std::uint32_t* end () const { return last; }
+        };
+
+        void build (const std::vector<SceneData::Light>& lights, float cutoff);
+
+        Span unbounded () const;
+        Span cell (const dvec3& p) const;
+
+        double radius (std::uint32_t light) const { return $radius [light]; }
+        double radius2 (std::uint32_t light) const { return $radius [light]*$radius [light]; }
+
+    private:
+        std::vector<double>         $radius;
+        std::vector<std::uint32_t>  $unbounded;
+        std::vector<std::uint32_t>  $offsets;
+        std::vector<std::uint32_t>  $indices;
+        dvec3                       $min;
+        dvec3                       $inv_cell;
+        ivec3                       $res;
+    };
+
+    /* Binary hierarchy over point lights for picking one light per sample
+       with probability roughly proportional to its contribution at the
+       shading point. Each node keeps the summed intensity of its lights and
+       the smallest attenuation terms among them, so the estimate at a node
+       never undershoots a light below it. */
+    struct LightTree {
+        struct Node {
+            vec3 min;
+            vec3 max;
+            vec3 attenuation;
+            float intensity;
+            std::uint32_t child;
+            std::int32_t light;
+        };
+
+        void build (const std::vector<SceneData::Light>& lights);
+
+        /* Walks down with u as the only random number, rescaling it at each
+           split. With oriented set, subtrees fully below the surface at p 
+           are skipped. */
+        bool sample (const dvec3& p, const dvec3& n, bool oriented, double u,
+            std::uint32_t& light, double& pdf) const;
+
+        bool empty () const { return $nodes.empty (); }
+
+    private:
+        float importance (const Node& node, const dvec3& p, const dvec3& n, bool oriented) const;
+        void build (const std::vector<SceneData::Light>& lights, std::uint32_t index, 
+            std::uint32_t* first, std::uint32_t* last);
+
+        std::vector<Node> $nodes;
+    };
+
+}
+
+#endif
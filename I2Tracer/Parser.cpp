@@ -15,22 +15,48 @@ inline _Ttype read (std::istream& in) {
     return t;
 }
 
+static bool same_material (const i2t::SceneData::Material& a, const i2t::SceneData::Material& b) {
+    return a.ambient == b.ambient && a.emission == b.emission && a.diffuse == b.diffuse
+        && a.specular == b.specular && a.power == b.power;
+}
+
 bool i2t::parse (SceneData& out, const std::string& name) {
+    return parse (out, name, std::string ());
+}
+
+bool i2t::parse (SceneData& out, const std::string& name, const std::string& spill) {
     static const auto stack_empty_error = std::runtime_error ("Transformation stack empty");
 
     using namespace i2t;
     typedef std::function<void (std::istream& args)> command_type;
     
     SceneData scene;
-    SceneData::Material material;
+    SceneData::Material material = {};
     std::vector<dvec4> vertexes;
     std::vector<std::pair<dvec4, dvec4>> vertexes_with_normals;
 
     vec3 attenuation = vec3 (1.0, 0.0, 0.0);
     dmat4 T = dmat4 (1.0);
     std::stack<dmat4> Tstack;
+    std::stack<std::size_t> Gstack;
 
-    static std::unordered_map<std::string, command_type> command_list = {
+    /* Spilled vertices are hashed as they go, the count last. */
+    std::ofstream spill_file;
+    auto spilled_hash = 14695981039346656037ull;
+    if (!spill.empty ()) {
+        spill_file.open (spill, std::ios::binary | std::ios::trunc);
+        if (!spill_file)
+            throw std::runtime_error ("Couldn't open " + spill);
+    }
+
+    auto close_group = [&] () {
+        auto& g = scene.$groups [Gstack.top ()];
+        g.triangles_end = std::uint32_t (scene.triangle_count ());
+        g.spheres_end = std::uint32_t (scene.$spheres.size ());
+        Gstack.pop ();
+    };
+
+    const std::unordered_map<std::string, command_type> command_list = {
         /* Configuration */
         {"size", [&] (std::istream& in) {
             scene.$camera.size.x = read<unsigned> (in); 
@@ -84,12 +110,24 @@ bool i2t::parse (SceneData& out, const std::string& name) {
             auto a = read<unsigned> (in);
             auto b = read<unsigned> (in);
             auto c = read<unsigned> (in);
-            scene.$triangles.push_back ({
-                material,
-                T*vertexes.at (a),
-                T*vertexes.at (b),
-                T*vertexes.at (c)
-            });
+            if (!spill_file.is_open ()) {
+                scene.$triangles.push_back ({
+                    material,
+                    T*vertexes.at (a),
+                    T*vertexes.at (b),
+                    T*vertexes.at (c)
+                });
+                return;
+            }
+            dvec3 v [3] = {dvec3 (T*vertexes.at (a)), dvec3 (T*vertexes.at (b)), dvec3 (T*vertexes.at (c))};
+            for (const auto& p: v)
+                spilled_hash = hash_value (p, spilled_hash);
+            spill_file.write (reinterpret_cast<const char*> (v), sizeof (v));
+            auto& materials = scene.$released_materials;
+            if (materials.empty () || !same_material (materials.back (), material))
+                materials.push_back (material);
+            scene.$released_material_ids.push_back (std::uint32_t (materials.size () - 1u));
+            ++scene.$released;
         }},
         {"trinormal", [&] (std::istream& in) {
             unsigned a, b, c;
@@ -129,12 +167,17 @@ bool i2t::parse (SceneData& out, const std::string& name) {
         }},
         {"pushTransform", [&] (std::istream& in) {
             Tstack.push (T);
+            Gstack.push (scene.$groups.size ());
+            auto t = std::uint32_t (scene.triangle_count ());
+            auto s = std::uint32_t (scene.$spheres.size ());
+            scene.$groups.push_back ({t, t, s, s});
         }},
         {"popTransform", [&] (std::istream& in) {
             if (Tstack.empty ())
                 throw stack_empty_error;
             T = Tstack.top ();
             Tstack.pop ();
+            close_group ();
         }},
 
             /* L    ights */
@@ -216,7 +259,131 @@ bool i2t::parse (SceneData& out, const std::string& name) {
         throw std::runtime_error (rte);
     }
     
-    out = scene;
+    while (!Gstack.empty ())
+        close_group ();
+    if (spill_file.is_open ()) {
+        spill_file.close ();
+        if (!spill_file)
+            throw std::runtime_error ("Couldn't write " + spill);
+        scene.$released_hash = hash_value (scene.$released_hash, hash_value (scene.$released, spilled_hash));
+        scene.$spill = spill;
+    }
+    for (auto& t: scene.$triangles)
+        t.material.classify ();
+    for (auto& m: scene.$released_materials)
+        m.classify ();
+    for (auto& s: scene.$spheres)
+        s.material.classify ();
+    out = std::move (scene);
 
     return false;
 }
+
+void i2t::SceneData::Material::classify () {
+    auto bits = unsigned (EMISSIVE);
+    if (diffuse != vec3 (0.0f))
+        bits |= DIFFUSE;
+    if (specular != vec3 (0.0f))
+        bits |= SPECULAR;
+    shading = Shading (bits);
+}
+
+const i2t::SceneData::Material& i2t::SceneData::material (std::size_t primitive) const {
+    if (primitive < $released)
+        return $released_materials [$released_material_ids [primitive]];
+    if (primitive < triangle_count ())
+        return $triangles.at (primitive - $released).material;
+    return $spheres.at (primitive - triangle_count ()).material;
+}
+
+void i2t::SceneData::set_material (std::size_t primitive, const Material& material) {
+    if (primitive < $released)
+        $released_materials [$released_material_ids [primitive]] = material;
+    else if (primitive < triangle_count ())
+        $triangles.at (primitive - $released).material = material;
+    else
+        $spheres.at (primitive - triangle_count ()).material = material;
+}
+
+void i2t::SceneData::transform (std::size_t group, const dmat4& M) {
+    const auto& g = $groups.at (group);
+    for (auto i = g.triangles_begin; i < g.triangles_end; ++i) {
+        auto& t = $triangles.at (i);
+        t.v0 = M*t.v0;
+        t.v1 = M*t.v1;
+        t.v2 = M*t.v2;
+    }
+    for (auto i = g.spheres_begin; i < g.spheres_end; ++i) {
+        auto& s = $spheres [i];
+        s.T = M*s.T;
+        s.inverseT = inverse (s.T);
+    }
+}
+
+static std::uint64_t hash_material (const i2t::SceneData::Material& m, std::uint64_t h) {
+    h = i2t::hash_value (m.ambient, h);
+    h = i2t::hash_value (m.emission, h);
+    h = i2t::hash_value (m.diffuse, h);
+    h = i2t::hash_value (m.specular, h);
+    return i2t::hash_value (m.power, h);
+}
+
+std::uint64_t i2t::SceneData::hash () const {
+    auto h = hash_value ($bounces, 14695981039346656037ull);
+    h = hash_value ($camera.size, h);
+    h = hash_value ($camera.up, h);
+    h = hash_value ($camera.eye, h);
+    h = hash_value ($camera.center, h);
+    h = hash_value ($camera.fov, h);
+    for (const auto& l: $lights) {
+        h = hash_value (l.position, h);
+        h = hash_value (l.color, h);
+        h = hash_value (l.attenuation, h);
+    }
+    for (const auto& t: $triangles) {
+        h = hash_material (t.material, h);
+        h = hash_value (t.v0, h);
+        h = hash_value (t.v1, h);
+        h = hash_value (t.v2, h);
+    }
+    if ($released) {
+        h = hash_value ($released_hash, h);
+        for (const auto& m: $released_materials)
+            h = hash_material (m, h);
+        h = hash_bytes ($released_material_ids.data (), $released_material_ids.size ()*sizeof (std::uint32_t), h);
+    }
+    for (const auto& s: $spheres) {
+        h = hash_material (s.material, h);
+        h = hash_value (s.T, h);
+    }
+    return h;
+}
+
+/* Hashed as a spill is, so a scene has the same hash released either
+   way. */
+void i2t::SceneData::release_triangles () {
+    if ($triangles.empty ())
+        return;
+    auto h = 14695981039346656037ull;
+    for (const auto& t: $triangles) {
+        h = hash_value (dvec3 (t.v0), h);
+        h = hash_value (dvec3 (t.v1), h);
+        h = hash_value (dvec3 (t.v2), h);
+    }
+    $released_hash = hash_value ($released_hash, hash_value ($triangles.size (), h));
+    for (const auto& t: $triangles) {
+        if ($released_materials.empty () || !same_material ($released_materials.back (), t.material))
+            $released_materials.push_back (t.material);
+        $released_material_ids.push_back (std::uint32_t ($released_materials.size () - 1u));
+    }
+    $released += $triangles.size ();
+    std::vector<Triangle> ().swap ($triangles);
+}
+
+bool i2t::SceneData::read_spill (std::size_t first, std::size_t count, dvec3* vertices) const {
+    if ($spill.empty () || first + count > $released)
+        return false;
+    std::ifstream in ($spill, std::ios::binary);
+    in.seekg (std::streamoff (first*3u*sizeof (dvec3)));
+    return bool (in.read (reinterpret_cast<char*> (vertices), std::streamsize (count*3u*sizeof (dvec3))));
+}
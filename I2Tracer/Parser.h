@@ -10,11 +10,23 @@ namespace i2t {
     struct SceneData {
 
         struct Material {
+            /* Which of the lit terms are nonzero, set when the scene is 
+               loaded. Emissive covers ambient and emission only. */
+            enum Shading: std::uint32_t {
+                EMISSIVE = 0u,
+                DIFFUSE = 1u,
+                SPECULAR = 2u,
+                PHONG = DIFFUSE|SPECULAR
+            };
+
             vec3 ambient;
             vec3 emission;
             vec3 diffuse;
             vec3 specular;
             double power;
+            Shading shading;
+
+            void classify ();
         };
 
         struct Triangle {
@@ -36,6 +48,15 @@ namespace i2t {
             vec3 attenuation;
         };
 
+        /* Primitives added between a pushTransform and its popTransform,
+           as ranges of triangles and of spheres. Groups are numbered in 
+           the order they're opened, so a nested group follows its parent
+           and lies within its ranges. */
+        struct Group {
+            std::uint32_t triangles_begin, triangles_end;
+            std::uint32_t spheres_begin, spheres_end;
+        };
+
         struct Camera {
             uvec2 size;
             dvec4 up;
@@ -46,12 +67,44 @@ namespace i2t {
 
         friend bool parse (SceneData& out, const std::string& name);
 
+        /* With spill set, triangles go to that file as they're read, their
+           world space vertices as nine doubles each, and are released as
+           by release_triangles (), so a scene needn't fit in memory. */
+        friend bool parse (SceneData& out, const std::string& name, const std::string& spill);
+
+        std::uint64_t hash () const;
+
         auto&& camera    () const { return $camera; }
         auto&& lights    () const { return $lights; }
         auto&& triangles () const { return $triangles; }
+        std::size_t triangle_count () const { return $triangles.size () + $released; }
+        auto&& spill     () const { return $spill; }
+        auto&& released_hash () const { return $released_hash; }
         auto&& spheres   () const { return $spheres; }   
+        auto&& groups    () const { return $groups; }
         auto&& bounces   () const { return $bounces; }
         auto&& output    () const { return $output ; }
+
+        /* Primitives are numbered triangles first, then spheres. Released
+           triangles share a material with the run of those next to them
+           that had the same one, and setting it sets it for the run. */
+        const Material& material (std::size_t primitive) const;
+        void set_material (std::size_t primitive, const Material& material);
+        void set_light (std::size_t index, const Light& light) { $lights.at (index) = light; }
+        void set_camera (const Camera& camera) { $camera = camera; }
+
+        /* Applies M on top of the transforms the group's primitives were 
+           loaded with. */
+        void transform (std::size_t group, const dmat4& M);
+
+        /* Drops the triangles once a copy is kept elsewhere. They still 
+           count in primitive numbers and keep their materials, and hash ()
+           covers their vertices as released. */
+        void release_triangles ();
+
+        /* Reads the vertices of count spilled triangles from first, three
+           to a triangle. False when the file can't give them all. */
+        bool read_spill (std::size_t first, std::size_t count, dvec3* vertices) const;
     private:
         unsigned                $bounces = 5u;
         std::string             $output  = "default"; 
@@ -67,6 +120,12 @@ namespace i2t {
         std::vector<Light>      $lights;
         std::vector<Triangle>   $triangles;
         std::vector<Sphere>     $spheres;      
+        std::vector<Group>      $groups;
+        std::size_t             $released = 0u;
+        std::uint64_t           $released_hash = 0u;
+        std::vector<Material>   $released_materials;
+        std::vector<std::uint32_t> $released_material_ids;
+        std::string             $spill;
     
     };
 
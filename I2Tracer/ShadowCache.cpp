@@ -0,0 +1,56 @@
+#include "ShadowCache.h"
+#include <cmath>
+#include <algorithm>
+
+/* Slot layout: tag from the high key bits, then the generation, then the
+   occluded flag. An empty slot is generation 0, which is never current. */
+static const unsigned TAG_SHIFT = 24u;
+static const std::uint32_t GENERATION_MASK = (1u << (TAG_SHIFT - 1u)) - 1u;
+
+void i2t::ShadowCache::reset (double cell, unsigned bits) {
+    $cell = cell;
+    $slots.reset ();
+    $mask = 0u;
+    if (!enabled ())
+        return;
+    bits = std::min (bits, TAG_SHIFT);
+    $slots.reset (new std::atomic<std::uint64_t> [std::size_t (1u) << bits]);
+    for (std::size_t i = 0u; i < (std::size_t (1u) << bits); ++i)
+        $slots [i].store (0u, std::memory_order_relaxed);
+    $mask = (std::uint64_t (1u) << bits) - 1u;
+    $generation = 1u;
+}
+
+void i2t::ShadowCache::invalidate () {
+    auto g = ($generation.load () + 1u) & GENERATION_MASK;
+    $generation = g ? g : 1u;
+}
+
+std::uint64_t i2t::ShadowCache::key (std::uint32_t primitive, std::uint32_t light, const dvec3& p) const {
+    std::int64_t q [3] = {
+        std::int64_t (std::floor (p.x/$cell)),
+        std::int64_t (std::floor (p.y/$cell)),
+        std::int64_t (std::floor (p.z/$cell))
+    };
+    auto h = hash_value (primitive, 14695981039346656037ull);
+    h = hash_value (light, h);
+    h = hash_bytes (q, sizeof (q), h);
+    /* FNV leaves the low bits weak, mix before they pick the slot. */
+    h = (h ^ (h >> 33))*0xff51afd7ed558ccdull;
+    return h ^ (h >> 33);
+}
+
+bool i2t::ShadowCache::find (std::uint64_t key, bool& occluded) const {
+    auto slot = $slots [key & $mask].load (std::memory_order_relaxed);
+    auto g = $generation.load (std::memory_order_relaxed);
+    if ((slot >> TAG_SHIFT) != (key >> TAG_SHIFT) || ((slot >> 1u) & GENERATION_MASK) != g)
+        return false;
+    occluded = (slot & 1u) != 0u;
+    return true;
+}
+
+void i2t::ShadowCache::insert (std::uint64_t key, bool occluded) {
+    auto g = $generation.load (std::memory_order_relaxed);
+    auto slot = ((key >> TAG_SHIFT) << TAG_SHIFT) | (std::uint64_t (g) << 1u) | (occluded ? 1u : 0u);
+    $slots [key & $mask].store (slot, std::memory_order_relaxed);
+}
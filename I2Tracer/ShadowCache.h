@@ -0,0 +1,34 @@
+#ifndef __SHADOWCACHE_H__
+#define __SHADOWCACHE_H__
+
+#include "Common.h"
+#include <memory>
+#include <atomic>
+
+namespace i2t {
+
+    /* Lossy table of shadow ray results, keyed by primitive, light and the
+       surface point quantized to cells of the given size, which bounds how
+       far a result is reused. Each slot is one atomic word overwritten 
+       without locking, so a collision only costs a miss. Bumping the 
+       generation drops every entry at once. */
+    struct ShadowCache {
+        void reset (double cell, unsigned bits = 20u);
+        void invalidate ();
+
+        bool enabled () const { return $cell > 0.0; }
+
+        std::uint64_t key (std::uint32_t primitive, std::uint32_t light, const dvec3& p) const;
+        bool find (std::uint64_t key, bool& occluded) const;
+        void insert (std::uint64_t key, bool occluded);
+
+    private:
+        std::unique_ptr<std::atomic<std::uint64_t> []> $slots;
+        std::uint64_t $mask = 0u;
+        double $cell = 0.0;
+        std::atomic<std::uint32_t> $generation {1u};
+    };
+
+}
+
+#endif
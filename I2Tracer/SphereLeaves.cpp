@@ -0,0 +1,143 @@
+#include "SphereLeaves.h"
+#include <cmath>
+#include <algorithm>
+
+#if defined (__AVX__)
+#   include <immintrin.h>
+#   define I2T_AVX
+#endif
+#if defined (_M_X64) || defined (__SSE2__)
+#   include <emmintrin.h>
+#   define I2T_SSE2
+#endif
+
+/* Padded by WIDTH - 1 entries that aren't round, so the last leaf's
+   loads stay inside. Left empty when no sphere is round. */
+void i2t::SphereLeaves::build (const SceneData& scene, const std::vector<std::uint32_t>& order) {
+    const auto triangles = std::uint32_t (scene.triangle_count ());
+    const auto size = order.size () + WIDTH - 1u;
+    $scale.assign (size, 0.0);
+    $x.assign (size, 0.0);
+    $y.assign (size, 0.0);
+    $z.assign (size, 0.0);
+    $round.assign (size, 0u);
+    auto any = false;
+    for (auto i = 0u; i < order.size (); ++i) {
+        if (order [i] < triangles)
+            continue;
+        const auto& M = scene.spheres () [order [i] - triangles].inverseT;
+        auto s = M [0][0];
+        auto uniform = s != 0.0 && M [1][1] == s && M [2][2] == s;
+        for (auto c = 0; c < 3; ++c)
+        for (auto r = 0; r < 4; ++r)
+            uniform = uniform && (r == c || M [c][r] == 0.0);
+        if (!uniform)
+            continue;
+        $scale [i] = s;
+        $x [i] = M [3][0];
+        $y [i] = M [3][1];
+        $z [i] = M [3][2];
+        $round [i] = 1u;
+        any = true;
+    }
+    if (!any) {
+        $scale.clear ();
+        $x.clear ();
+        $y.clear ();
+        $z.clear ();
+        $round.clear ();
+    }
+}
+
+/* canonical_sphere_intersect () step for step, with the copysign done on
+   the sign bit and the swap and the choice of root as blends. Lanes that
+   aren't round have a zero scale and are masked out by it. */
+unsigned i2t::SphereLeaves::intersect (std::uint32_t first, const dvec3& ro, const dvec3& rd,
+    double tmin, double tmax, double* t) const
+{
+#if defined (I2T_AVX)
+    auto zero = _mm256_setzero_pd ();
+    auto sign = _mm256_set1_pd (-0.0);
+    auto s = _mm256_loadu_pd (&$scale [first]);
+    auto ox = _mm256_add_pd (_mm256_mul_pd (s, _mm256_set1_pd (ro.x)), _mm256_loadu_pd (&$x [first]));
+    auto oy = _mm256_add_pd (_mm256_mul_pd (s, _mm256_set1_pd (ro.y)), _mm256_loadu_pd (&$y [first]));
+    auto oz = _mm256_add_pd (_mm256_mul_pd (s, _mm256_set1_pd (ro.z)), _mm256_loadu_pd (&$z [first]));
+    auto dx = _mm256_mul_pd (s, _mm256_set1_pd (rd.x));
+    auto dy = _mm256_mul_pd (s, _mm256_set1_pd (rd.y));
+    auto dz = _mm256_mul_pd (s, _mm256_set1_pd (rd.z));
+    auto a = _mm256_add_pd (_mm256_add_pd (_mm256_mul_pd (dx, dx), _mm256_mul_pd (dy, dy)), _mm256_mul_pd (dz, dz));
+    auto b = _mm256_add_pd (_mm256_add_pd (_mm256_mul_pd (dx, ox), _mm256_mul_pd (dy, oy)), _mm256_mul_pd (dz, oz));
+    b = _mm256_mul_pd (b, _mm256_set1_pd (2.0));
+    auto c = _mm256_add_pd (_mm256_add_pd (_mm256_mul_pd (ox, ox), _mm256_mul_pd (oy, oy)), _mm256_mul_pd (oz, oz));
+    c = _mm256_sub_pd (c, _mm256_set1_pd (1.0));
+    auto disc = _mm256_sub_pd (_mm256_mul_pd (b, b), _mm256_mul_pd (_mm256_mul_pd (_mm256_set1_pd (4.0), a), c));
+    auto root = _mm256_or_pd (_mm256_andnot_pd (sign, _mm256_sqrt_pd (disc)), _mm256_and_pd (sign, b));
+    auto q = _mm256_mul_pd (_mm256_set1_pd (0.5), _mm256_sub_pd (root, b));
+    auto t0 = _mm256_div_pd (q, a);
+    auto t1 = _mm256_div_pd (c, q);
+    auto swap = _mm256_cmp_pd (t0, t1, _CMP_GT_OQ);
+    auto lo = _mm256_blendv_pd (t0, t1, swap);
+    auto hi = _mm256_blendv_pd (t1, t0, swap);
+    auto tt = _mm256_blendv_pd (lo, hi, _mm256_cmp_pd (lo, zero, _CMP_LT_OQ));
+    auto valid = _mm256_and_pd (_mm256_cmp_pd (disc, zero, _CMP_GE_OQ), _mm256_cmp_pd (hi, zero, _CMP_NLT_UQ));
+    valid = _mm256_and_pd (valid, _mm256_cmp_pd (s, zero, _CMP_NEQ_OQ));
+    valid = _mm256_and_pd (valid, _mm256_cmp_pd (tt, _mm256_set1_pd (tmin), _CMP_GT_OQ));
+    valid = _mm256_and_pd (valid, _mm256_cmp_pd (tt, _mm256_set1_pd (tmax), _CMP_LE_OQ));
+    _mm256_storeu_pd (t, tt);
+    return unsigned (_mm256_movemask_pd (valid));
+#elif defined (I2T_SSE2)
+    auto mask = 0u;
+    auto zero = _mm_setzero_pd ();
+    auto sign = _mm_set1_pd (-0.0);
+    auto blend = [] (__m128d a, __m128d b, __m128d m) { return _mm_or_pd (_mm_andnot_pd (m, a), _mm_and_pd (m, b)); };
+    for (auto k = 0u; k < WIDTH; k += 2u) {
+        auto s = _mm_loadu_pd (&$scale [first + k]);
+        auto ox = _mm_add_pd (_mm_mul_pd (s, _mm_set1_pd (ro.x)), _mm_loadu_pd (&$x [first + k]));
+        auto oy = _mm_add_pd (_mm_mul_pd (s, _mm_set1_pd (ro.y)), _mm_loadu_pd (&$y [first + k]));
+        auto oz = _mm_add_pd (_mm_mul_pd (s, _mm_set1_pd (ro.z)), _mm_loadu_pd (&$z [first + k]));
+        auto dx = _mm_mul_pd (s, _mm_set1_pd (rd.x));
+        auto dy = _mm_mul_pd (s, _mm_set1_pd (rd.y));
+        auto dz = _mm_mul_pd (s, _mm_set1_pd (rd.z));
+        auto a = _mm_add_pd (_mm_add_pd (_mm_mul_pd (dx, dx), _mm_mul_pd (dy, dy)), _mm_mul_pd (dz, dz));
+        auto b = _mm_add_pd (_mm_add_pd (_mm_mul_pd (dx, ox), _mm_mul_pd (dy, oy)), _mm_mul_pd (dz, oz));
+        b = _mm_mul_pd (b, _mm_set1_pd (2.0));
+        auto c = _mm_add_pd (_mm_add_pd (_mm_mul_pd (ox, ox), _mm_mul_pd (oy, oy)), _mm_mul_pd (oz, oz));
+        c = _mm_sub_pd (c, _mm_set1_pd (1.0));
+        auto disc = _mm_sub_pd (_mm_mul_pd (b, b), _mm_mul_pd (_mm_mul_pd (_mm_set1_pd (4.0), a), c));
+        auto root = _mm_or_pd (_mm_andnot_pd (sign, _mm_sqrt_pd (disc)), _mm_and_pd (sign, b));
+        auto q = _mm_mul_pd (_mm_set1_pd (0.5), _mm_sub_pd (root, b));
+        auto t0 = _mm_div_pd (q, a);
+        auto t1 = _mm_div_pd (c, q);
+        auto swap = _mm_cmpgt_pd (t0, t1);
+        auto lo = blend (t0, t1, swap);
+        auto hi = blend (t1, t0, swap);
+        auto tt = blend (lo, hi, _mm_cmplt_pd (lo, zero));
+        auto valid = _mm_and_pd (_mm_cmpge_pd (disc, zero), _mm_cmpnlt_pd (hi, zero));
+        valid = _mm_and_pd (valid, _mm_cmpneq_pd (s, zero));
+        valid = _mm_and_pd (valid, _mm_cmpgt_pd (tt, _mm_set1_pd (tmin)));
+        valid = _mm_and_pd (valid, _mm_cmple_pd (tt, _mm_set1_pd (tmax)));
+        _mm_storeu_pd (t + k, tt);
+        mask |= unsigned (_mm_movemask_pd (valid)) << k;
+    }
+    return mask;
+#else
+    auto mask = 0u;
+    for (auto k = 0u; k < WIDTH; ++k) {
+        auto s = $scale [first + k];
+        auto o = dvec3 (s*ro.x + $x [first + k], s*ro.y + $y [first + k], s*ro.z + $z [first + k]);
+        auto d = s*rd;
+        auto a = dot (d, d);
+        auto b = dot (d, o)*2.0;
+        auto c = dot (o, o) - 1.0;
+        auto disc = b*b - 4.0*a*c;
+        auto q = 0.5*(std::copysign (std::sqrt (std::max (disc, 0.0)), b) - b);
+        auto t0 = q/a;
+        auto t1 = c/q;
+        if (t0 > t1)
+            std::swap (t0, t1);
+        t [k] = t0 < 0.0 ? t1 : t0;
+        mask |= unsigned (s != 0.0 && disc >= 0.0 && !(t1 < 0.0) && t [k] > tmin && t [k] <= tmax) << k;
+    }
+    return mask;
+#endif
+}
@@ -0,0 +1,51 @@
+#ifndef __SPHERELEAVES_H__
+#define __SPHERELEAVES_H__
+
+#include "Parser.h"
+#include "Common.h"
+#include <vector>
+
+namespace i2t {
+
+    /* Spheres of a primitive order in SoA form, entry i for the primitive
+       at position i, so the spheres of a leaf are tested WIDTH at a time
+       without gathering. Only round spheres are kept, those whose inverse
+       transform is a uniform scale and a translation: scale is one over
+       the radius and x, y, z minus the centre over the radius, just as the
+       inverse transform holds them. A ray mapped through them lands on the
+       unit sphere with the same rounding as through the matrix, so t comes
+       out exactly as from Core::canonical_sphere_intersect. */
+    struct SphereLeaves {
+        static const unsigned WIDTH = 4u;
+
+        /* Primitive numbers past the scene's triangles are spheres. */
+        void build (const SceneData& scene, const std::vector<std::uint32_t>& order);
+        bool empty () const { return $round.empty (); }
+
+        /* Bit k set when entry first + k is a round sphere, for the count
+           entries from first, at most WIDTH. */
+        unsigned round (std::uint32_t first, unsigned count) const {
+            auto mask = 0u;
+            if (!$round.empty ())
+                for (auto k = 0u; k < count; ++k)
+                    mask |= unsigned ($round [first + k]) << k;
+            return mask;
+        }
+
+        /* Bit k set when entry first + k is a round sphere the ray hits at
+           a t in (tmin, tmax], which goes to t [k]. Branch free over the
+           WIDTH entries from first, whether or not they're in the order. */
+        unsigned intersect (std::uint32_t first, const dvec3& ro, const dvec3& rd,
+            double tmin, double tmax, double* t) const;
+
+    private:
+        std::vector<double>         $scale;
+        std::vector<double>         $x;
+        std::vector<double>         $y;
+        std::vector<double>         $z;
+        std::vector<std::uint8_t>   $round;
+    };
+
+}
+
+#endif
@@ -1,29 +1,205 @@
 #include <cstdlib>
+#include <cstdio>
 #include <iostream>
 #include <string>
 #include <thread>
 #include <atomic>
 #include <chrono>
+#include <algorithm>
+#include <random>
+#include <stdexcept>
 
 #define SDL_MAIN_HANDLED
 #include <SDL.h>
 
 #include "Parser.h"
 #include "Core.h"
+#include "Cluster.h"
 
 int main (int argc, char** argv) try {
+    std::string scene_name = "scene5.test";
+    i2t::CancelToken cancel;
+    i2t::RenderControl control;
+    control.cancel = &cancel;
+
+    i2t::CoreOptions options;
+    i2t::ClusterOptions cluster;
+    auto coordinator = false;
+    std::string worker_host;
+    unsigned short worker_port = 0u;
+    auto passes = 1u;
+
+    for (auto i = 1; i < argc; ++i) {
+        std::string arg = argv [i];
+        if (arg == "--workers" && i + 1 < argc) {
+            cluster.local_workers = std::stoul (argv [++i]);
+            coordinator = true;
+            continue;
+        }
+        if (arg == "--listen" && i + 1 < argc) {
+            cluster.port = (unsigned short)std::stoul (argv [++i]);
+            coordinator = true;
+            continue;
+        }
+        if (arg == "--bucket" && i + 1 < argc) {
+            cluster.bucket_size = std::stoul (argv [++i]);
+            continue;
+        }
+        if (arg == "--checkpoint" && i + 1 < argc) {
+            control.checkpoint = argv [++i];
+            continue;
+        }
+        if (arg == "--checkpoint-interval" && i + 1 < argc) {
+            control.checkpoint_interval = std::chrono::seconds (std::stoul (argv [++i]));
+            continue;
+        }
+        if (arg == "--light-cutoff" && i + 1 < argc) {
+            options.light_cutoff = std::stof (argv [++i]);
+            continue;
+        }
+        if (arg == "--light-samples" && i + 1 < argc) {
+            options.light_samples = std::stoul (argv [++i]);
+            continue;
+        }
+        if (arg == "--shadow-cache" && i + 1 < argc) {
+            options.shadow_cache_cell = std::stod (argv [++i]);
+            continue;
+        }
+        if (arg == "--throughput-cutoff" && i + 1 < argc) {
+            options.throughput_cutoff = std::stof (argv [++i]);
+            continue;
+        }
+        if (arg == "--roulette" && i + 1 < argc) {
+            options.roulette_depth = std::stoul (argv [++i]);
+            continue;
+        }
+        if (arg == "--samples" && i + 1 < argc) {
+            options.pixel_samples = std::stoul (argv [++i]);
+            if (options.jitter == i2t::Jitter::none)
+                options.jitter = i2t::Jitter::rotated;
+            continue;
+        }
+        if (arg == "--jitter" && i + 1 < argc) {
+            std::string name = argv [++i];
+            options.jitter = name == "grid" ? i2t::Jitter::grid
+                : name == "rotated" ? i2t::Jitter::rotated
+                : name == "random" ? i2t::Jitter::random 
+                : i2t::Jitter::none;
+            continue;
+        }
+        if (arg == "--gbuffer") {
+            options.gbuffer = true;
+            continue;
+        }
+        if (arg == "--accel" && i + 1 < argc) {
+            std::string name = argv [++i];
+            options.accelerator = name == "grid" ? i2t::Accelerator::grid
+                : name == "auto" ? i2t::Accelerator::automatic
+                : i2t::Accelerator::bvh;
+            continue;
+        }
+        if (arg == "--bvh" && i + 1 < argc) {
+            std::string name = argv [++i];
+            options.bvh_quality = name == "balanced" ? i2t::BvhQuality::balanced
+                : name == "high" ? i2t::BvhQuality::high
+                : name == "spatial" ? i2t::BvhQuality::spatial
+                : i2t::BvhQuality::fast;
+            continue;
+        }
+        if (arg == "--bvh-cache" && i + 1 < argc) {
+            options.bvh_cache = argv [++i];
+            continue;
+        }
+        if (arg == "--bvh-duplication" && i + 1 < argc) {
+            options.bvh_duplication = std::stod (argv [++i]);
+            continue;
+        }
+        if (arg == "--bvh-width" && i + 1 < argc) {
+            options.bvh_width = std::stoul (argv [++i]);
+            continue;
+        }
+        if (arg == "--bvh-compressed") {
+            options.bvh_compressed = true;
+            continue;
+        }
+        if (arg == "--out-of-core" && i + 1 < argc) {
+            options.geometry_file = argv [++i];
+            continue;
+        }
+        if (arg == "--geometry-budget" && i + 1 < argc) {
+            options.geometry_budget = std::size_t (std::stoul (argv [++i])) << 20u;
+            continue;
+        }
+        if (arg == "--cull") {
+            options.cull_tiles = true;
+            continue;
+        }
+        if (arg == "--stream") {
+            options.stream = true;
+            continue;
+        }
+        if (arg == "--passes" && i + 1 < argc) {
+            passes = std::max (1u, unsigned (std::stoul (argv [++i])));
+            continue;
+        }
+        if (arg == "--worker" && i + 1 < argc) {
+            std::string address = argv [++i];
+            auto colon = address.rfind (':');
+            worker_host = address.substr (0, colon);
+            worker_port = (unsigned short)std::stoul (address.substr (colon + 1));
+            continue;
+        }
+        if (arg == "--crop" && i + 4 < argc) {
+            i2t::Region region;
+            region.origin.x = std::stoul (argv [++i]);
+            region.origin.y = std::stoul (argv [++i]);
+            region.size.x = std::stoul (argv [++i]);
+            region.size.y = std::stoul (argv [++i]);
+            control.regions.push_back (region);
+            continue;
+        }
+        scene_name = arg;
+    }
+
+    /* Workers are handed buckets of a single pass. */
+    if (coordinator && passes > 1u)
+        throw std::runtime_error ("--passes can't be used with --workers or --listen");
+
     i2t::SceneData scene;
     //i2t::parse (scene, "scene4-ambient.test");    
     //i2t::parse (scene, "scene4-emission.test");
     //i2t::parse (scene, "scene4-diffuse.test");
     //i2t::parse (scene, "scene4-specular.test");
-    i2t::parse (scene, "scene5.test");
+    /* Local workers share the coordinator's arguments, and each needs a
+       geometry file of its own. Out of core, the triangles are spilled
+       next to it as they're read, and the spill is done with once the
+       store holds them. */
+    if (!worker_host.empty () && !options.geometry_file.empty ())
+        options.geometry_file += "." + std::to_string (std::random_device () ());
+    auto spill = options.geometry_file.empty () ? std::string () : options.geometry_file + ".spill";
+    i2t::parse (scene, scene_name, spill);
     //i2t::parse (scene, "scene6.test");
     //i2t::parse (scene, "foo.test");
     //i2t::parse (scene, "scene7.test");
 
     //i2t::parse (scene, "foo.test");
-    i2t::Core core (scene);
+
+    i2t::Core core (scene, options);
+    if (!spill.empty ())
+        std::remove (spill.c_str ());
+
+    if (!worker_host.empty ())
+        return i2t::render_worker (core, scene, worker_host, worker_port) ? 0 : -1;
+    /* Workers get every argument bar those making a process coordinator
+       or worker, so they load the scene and render it the same way. */
+    cluster.worker_command = "\"" + std::string (argv [0]) + "\"";
+    for (auto i = 1; i < argc; ++i) {
+        std::string arg = argv [i];
+        if ((arg == "--workers" || arg == "--listen" || arg == "--worker") && i + 1 < argc)
+            ++i;
+        else
+            cluster.worker_command += " \"" + arg + "\"";
+    }
 
     SDL_Init (SDL_INIT_EVERYTHING);
     std::atexit (SDL_Quit);
@@ -37,18 +213,118 @@ int main (int argc, char** argv) try {
 
     auto pSurface = SDL_GetWindowSurface (pWindow);
     
-    std::thread _render_thread ([&core] () {
-        core.render ();
-    });
+    std::thread _render_thread;
+    auto start_render = [&] () {
+        _render_thread = std::thread ([&] () {
+            i2t::RenderProgress progress;
+            progress.status = i2t::RenderStatus::complete;
+            auto pass_control = control;
+            if (coordinator)
+                progress = i2t::render_coordinator (core, scene, cluster, control);
+            else {
+                /* Holes first, so a camera move fills in quickly, then the
+                   stale pixels, then any further passes over everything.
+                   A pass that left a checkpoint behind is resumed without
+                   running those before it, which would overwrite it. */
+                auto first_pixels = control.regions.empty () ? i2t::RenderPixels::stale : control.pixels;
+                auto set_pass = [&] (unsigned pass) {
+                    pass_control.pass = pass;
+                    pass_control.pixels = pass ? i2t::RenderPixels::all : first_pixels;
+                };
+                auto resume = passes;
+                for (auto pass = passes; pass-- > 0u && !control.checkpoint.empty ();) {
+                    set_pass (pass);
+                    if (core.resumable (pass_control)) {
+                        resume = pass;
+                        break;
+                    }
+                }
+                if (resume == passes && control.regions.empty ()) {
+                    pass_control.pixels = i2t::RenderPixels::holes;
+                    progress = core.render (pass_control);
+                }
+                for (auto pass = resume == passes ? 0u : resume; pass < passes; ++pass) {
+                    if (progress.status != i2t::RenderStatus::complete)
+                        break;
+                    set_pass (pass);
+                    progress = core.render (pass_control);
+                }
+            }
+            std::cout << "Rendered " << progress.tiles_done << "/" 
+                << progress.tiles_total << " tiles\n";
+            if (progress.status == i2t::RenderStatus::geometry_unreadable)
+                std::cout << "Stopped, geometry couldn't be read back from " << options.geometry_file << "\n";
+        });
+    };
+    auto stop_render = [&] () {
+        cancel.cancel ();
+        _render_thread.join ();
+        cancel.reset ();
+    };
+
+    start_render ();
+    i2t::ivec2 drag_start;
+    auto selected_light = 0u;
 
     for (;;) {
         SDL_Event ev;
         if (SDL_PollEvent (&ev)) {
             if (ev.type == SDL_QUIT)
                 break;
+            /* L picks a light, up and down make it brighter or dimmer. */
+            if (ev.type == SDL_KEYDOWN && !scene.lights ().empty () && !coordinator) {
+                auto key = ev.key.keysym.sym;
+                if (key == SDLK_l) {
+                    selected_light = (selected_light + 1u) % scene.lights ().size ();
+                    std::cout << "Light " << selected_light << "\n";
+                }
+                if (key == SDLK_UP || key == SDLK_DOWN) {
+                    stop_render ();
+                    auto light = scene.lights () [selected_light];
+                    light.color *= key == SDLK_UP ? 1.25f : 0.8f;
+                    scene.set_light (selected_light, light);
+                    core.set_light (selected_light, light);
+                    start_render ();
+                }
+            }
+            /* WASD moves the camera, the frame is reprojected meanwhile. */
+            if (ev.type == SDL_KEYDOWN && !coordinator) {
+                auto key = ev.key.keysym.sym;
+                auto camera = scene.camera ();
+                auto forward = normalize (i2t::dvec3 (camera.center - camera.eye));
+                auto right = normalize (cross (forward, i2t::dvec3 (camera.up)));
+                auto step = 0.05*length (i2t::dvec3 (camera.center - camera.eye));
+                auto move = i2t::dvec3 (0.0);
+                if (key == SDLK_w) move = forward*step;
+                if (key == SDLK_s) move = -forward*step;
+                if (key == SDLK_d) move = right*step;
+                if (key == SDLK_a) move = -right*step;
+                if (move != i2t::dvec3 (0.0)) {
+                    stop_render ();
+                    camera.eye += i2t::dvec4 (move, 0.0);
+                    camera.center += i2t::dvec4 (move, 0.0);
+                    scene.set_camera (camera);
+                    core.set_camera (camera);
+                    control.regions.clear ();
+                    start_render ();
+                }
+            }
             if (ev.type == SDL_MOUSEBUTTONDOWN) {
                 std::cout << ev.button.x << ", ";
                 std::cout << ev.button.y << "\n";
+                drag_start = i2t::ivec2 (ev.button.x, ev.button.y);
+            }
+            if (ev.type == SDL_MOUSEBUTTONUP) {
+                auto a = min (drag_start, i2t::ivec2 (ev.button.x, ev.button.y));
+                auto b = max (drag_start, i2t::ivec2 (ev.button.x, ev.button.y));
+                if (b.x - a.x > 2 && b.y - a.y > 2) {
+                    stop_render ();
+                    i2t::Region region;
+                    region.origin = i2t::uvec2 (max (a, i2t::ivec2 (0)));
+                    region.size = i2t::uvec2 (b - max (a, i2t::ivec2 (0)));
+                    control.regions.assign (1, region);
+                    start_render ();
+                }
             }
             continue;
         }
@@ -64,9 +340,9 @@ int main (int argc, char** argv) try {
         SDL_UnlockSurface (pSurface);
         SDL_UpdateWindowSurface (pWindow);
     }
+    stop_render ();
     SDL_SaveBMP (pSurface, (scene.output () + ".bmp").c_str ());
     SDL_DestroyWindow (pWindow);
-    _render_thread.detach ();
     return 0;
 }
 catch (std::exception& e) {